@@ -0,0 +1,44 @@
+/* 
+   bounded_queue.h
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __BOUNDED_QUEUE_H__
+#define __BOUNDED_QUEUE_H__
+
+#include <pthread.h>
+
+typedef struct bounded_queue {
+	void **items;
+	int capacity;
+	int head;
+	int count;
+	char closed;
+	pthread_mutex_t lock;
+	pthread_cond_t not_empty;
+	pthread_cond_t not_full;
+} bounded_queue_t;
+
+bounded_queue_t *bounded_queue_create(int capacity);
+int bounded_queue_push(bounded_queue_t *queue, void *item);
+int bounded_queue_try_push(bounded_queue_t *queue, void *item);
+void *bounded_queue_pop(bounded_queue_t *queue);
+void bounded_queue_close(bounded_queue_t *queue);
+void bounded_queue_free(bounded_queue_t *queue);
+
+#endif
+
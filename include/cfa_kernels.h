@@ -0,0 +1,51 @@
+/* 
+   cfa_kernels.h
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __CFA_KERNELS_H__
+#define __CFA_KERNELS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+#define CFA_MAX_BINNING 3
+
+/* visible area of the 2x2 Bayer mosaic */
+typedef struct cfa_image {
+	const uint16_t *data;
+	size_t pitch;
+	size_t width;
+	size_t height;
+	int color[2][2];	/* 0 - red, 1 - green, 2 - blue, by (row & 1, col & 1) */
+} cfa_image_t;
+
+/* 
+   Binned frame is (width / bin) x (height / bin), incomplete blocks at the edges are dropped.
+   Rows are stored bottom-up, rows [first_row, first_row + rows) of the binned frame are made
+   and written from the start of dst (planes).
+ */
+void cfa_bin_mono(const cfa_image_t *cfa, int bin, int sum, uint16_t *dst, size_t first_row, size_t rows);
+void cfa_bin_rgb(const cfa_image_t *cfa, int bin, int sum, uint16_t **planes, size_t first_row, size_t rows);
+
+/* 
+   Full resolution channel (0 - red, 1 - green, 2 - blue) by bilinear interpolation,
+   rows are stored bottom-up and written from the start of dst. Mosaic must be at least 2x2.
+ */
+void cfa_interpolate(const cfa_image_t *cfa, int channel, uint16_t *dst, size_t first_row, size_t rows);
+
+#endif
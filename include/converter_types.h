@@ -27,7 +27,8 @@ typedef enum frame_mode {
 	ALL_CHANNELS,
 	RED_ONLY,
 	GREEN_ONLY,
-	BLUE_ONLY
+	BLUE_ONLY,
+	RAW_CFA
 } FRAME_MODE;
 
 typedef enum file_naming {
@@ -37,6 +38,36 @@ typedef enum file_naming {
 	RAW_DATETIME
 } file_naming_t;
 
+typedef enum log_level {
+	LOG_LEVEL_NONE = 0,
+	LOG_LEVEL_ERROR,
+	LOG_LEVEL_INFO,
+	LOG_LEVEL_DEBUG,
+	LOG_LEVEL_TRACE
+} log_level_t;
+
+typedef enum schedule_mode {
+	SCHEDULE_READDIR = 0,
+	SCHEDULE_LARGEST_FIRST
+} schedule_mode_t;
+
+typedef enum fits_backend {
+	FITS_BACKEND_CFITSIO = 0,
+	FITS_BACKEND_NATIVE
+} fits_backend_t;
+
+typedef enum cfa_channels {
+	CFA_CHANNELS_DEBAYER = 0,
+	CFA_CHANNELS_HALF,
+	CFA_CHANNELS_FULL
+} cfa_channels_t;
+
+typedef enum normalize_mode {
+	NORMALIZE_NONE = 0,
+	NORMALIZE_RANGE,
+	NORMALIZE_EXPTIME
+} normalize_mode_t;
+
 typedef struct coordinates {
 	short hour;
 	short min;
@@ -77,15 +108,28 @@ typedef struct image_setup {
 	char apply_auto_bright;
 	char apply_interpolation;
 	char apply_autoscale;
+	int binning;
+	char binning_sum;
+	cfa_channels_t cfa_channels;
+	int bitpix;
+	normalize_mode_t normalize;
 } image_setup_t;
 
 typedef struct file_setup {
 	file_naming_t naming;
 	char overwrite;
+	char recursive;
 } file_setup_t;
 
+typedef struct progress_stats {
+	int files_done;
+	int files_total;
+	long bytes_done;
+	float rate;
+} progress_stats_t;
+
 typedef void (*progress_setup_cb) (void*, int);
-typedef void (*progress_update_cb) (void*);
+typedef void (*progress_update_cb) (void*, progress_stats_t*);
 
 typedef struct progress_params {
 	void *progr_arg;
@@ -104,7 +148,11 @@ typedef struct converter_params {
 	file_metadata_t meta;
 	image_setup_t imsetup;
 	file_setup_t fsetup;
+	schedule_mode_t schedule;
+	fits_backend_t fits_backend;
+	char kernel[16];
 	progress_params_t progress;
+	log_level_t log_level;
 	void *logger_arg;
 	logger_msg_cb logger_msg;
 	void *done_arg;
@@ -23,18 +23,20 @@
 #include <stdint.h>
 #include "converter_types.h"
 
+#define MAX_FILE_VENDORS 16
+
 typedef struct file_info {
 	char file_vendor[25];
+	int vendor_id;
 	long file_size;
 	uint8_t file_supported;
 } file_info_t;
 
-void get_file_info(char *fname, file_info_t *finf);
-long get_file_size(char *fname);
+void get_file_vendor(char *fname, file_info_t *finf);
 int is_file_exist(char *filename);
 int remove_file(const char *filename);
 
-void make_target_fits_filename(converter_params_t *arg, char *raw_filename, char *out_filename, char *postfix);
+void make_target_fits_filename(converter_params_t *arg, file_metadata_t *meta, char *raw_filename, char *out_filename, char *postfix);
 
 #endif
 
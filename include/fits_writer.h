@@ -0,0 +1,55 @@
+/* 
+   fits_writer.h
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __FITS_WRITER_H__
+#define __FITS_WRITER_H__
+
+#include <stddef.h>
+
+#define FITS_BLOCK_SIZE 2880
+#define FITS_CARD_SIZE 80
+
+/* 
+   Calls follow cfitsio: datatypes and status codes are the cfitsio ones,
+   nothing is done when the status is already set.
+ */
+typedef struct fits_writer {
+	int fd;
+	int hdus;
+	char *header;
+	size_t header_len;
+	size_t header_size;
+} fits_writer_t;
+
+int fits_writer_create(fits_writer_t *fw, const char *filename, int *status);
+int fits_writer_create_img(fits_writer_t *fw, int bitpix, int width, int height, int *status);
+int fits_writer_write_key(fits_writer_t *fw, int datatype, const char *keyname, void *value,
+										const char *comment, int *status);
+int fits_writer_write_comment(fits_writer_t *fw, const char *comment, int *status);
+int fits_writer_write_record(fits_writer_t *fw, const char *card, int *status);
+
+/* card is FITS_CARD_SIZE + 1 bytes, formatted as fits_writer_write_key() does it */
+int fits_writer_make_key(int datatype, const char *keyname, void *value, const char *comment,
+										char *card, int *status);
+
+/* 16-bit frames must be in the FITS order already, float frames are swapped in place */
+int fits_writer_write_image(fits_writer_t *fw, void *frame, int width, int height, int bitpix, int *status);
+int fits_writer_close(fits_writer_t *fw, int *status);
+
+#endif
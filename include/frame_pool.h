@@ -0,0 +1,35 @@
+/* 
+   frame_pool.h
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __FRAME_POOL_H__
+#define __FRAME_POOL_H__
+
+#include <stddef.h>
+
+typedef struct frame_buf {
+	void *data;
+	size_t capacity;
+	struct frame_buf *next;
+} frame_buf_t;
+
+frame_buf_t *frame_pool_get(size_t size);
+void frame_pool_put(frame_buf_t *buf);
+void frame_pool_cleanup();
+
+#endif
@@ -20,16 +20,51 @@
 #ifndef __LIST_H__
 #define __LIST_H__
 
-typedef struct node {
-    char *object;
-    struct node *next;
-} list_node_t;
+#include <stddef.h>
 
-typedef void (*iterate_cb)(char*, void*);
+#define FILE_LIST_CHUNK_SHIFT 10
+#define FILE_LIST_CHUNK_SIZE (1 << FILE_LIST_CHUNK_SHIFT)
+#define FILE_LIST_MAX_CHUNKS 4096
+#define FILE_LIST_ARENA_BLOCK (256 * 1024)
 
-list_node_t *add_object_to_list(list_node_t *list, char *object);
-void free_list(list_node_t *list);
-void iterate_list_cb(list_node_t *list, iterate_cb cb, void* arg, int offset, int count, char *sflag);
+typedef enum file_state {
+	FILE_FOUND = 0,
+	FILE_QUEUED,
+	FILE_DONE,
+	FILE_FAILED
+} file_state_t;
 
-#endif
+typedef struct file_entry {
+	char *path;
+	long size;
+	long weight;
+	int tag;
+	int state;
+} file_entry_t;
+
+typedef struct string_block {
+	struct string_block *next;
+	size_t size;
+	size_t used;
+	char data[];
+} string_block_t;
 
+/* 
+   Entries are stored in the fixed size chunks which are never moved,
+   so the entry and its path stay valid while the list is growing.
+ */
+typedef struct file_list {
+	file_entry_t *chunks[FILE_LIST_MAX_CHUNKS];
+	string_block_t *strings;
+	int count;
+	int next_claim;
+} file_list_t;
+
+file_list_t *file_list_create();
+int file_list_add(file_list_t *list, const char *path, long size, long weight, int tag);
+file_entry_t *file_list_get(file_list_t *list, int index);
+int file_list_claim(file_list_t *list);
+int *file_list_sort_by_weight(file_list_t *list);
+void file_list_free(file_list_t *list);
+
+#endif
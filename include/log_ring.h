@@ -0,0 +1,54 @@
+/* 
+   log_ring.h
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __LOG_RING_H__
+#define __LOG_RING_H__
+
+#include <stdarg.h>
+#include <pthread.h>
+#include <semaphore.h>
+
+#define LOG_RING_MSG_SIZE 256
+#define LOG_RING_BATCH_SIZE 4096
+
+typedef void (*log_ring_sink) (void *arg, const char *text);
+
+typedef struct log_ring_slot {
+	unsigned long seq;
+	char msg[LOG_RING_MSG_SIZE];
+} log_ring_slot_t;
+
+typedef struct log_ring {
+	log_ring_slot_t *slots;
+	unsigned long mask;
+	unsigned long head;
+	unsigned long tail;
+	unsigned long dropped;
+	char stop;
+	sem_t ready;
+	pthread_t consumer;
+	log_ring_sink sink;
+	void *sink_arg;
+} log_ring_t;
+
+log_ring_t *log_ring_create(int capacity, log_ring_sink sink, void *sink_arg);
+int log_ring_vprintf(log_ring_t *ring, const char *fmt, va_list args);
+void log_ring_free(log_ring_t *ring);
+
+#endif
@@ -0,0 +1,47 @@
+/* 
+   logger.h
+    - levelled logging through the converter params
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __LOGGER_H__
+#define __LOGGER_H__
+
+#include "converter_types.h"
+
+/* disabled level costs one comparison, arguments are not evaluated */
+#define log_enabled(params, level) ((level) <= (params)->log_level)
+
+#define log_msg(params, level, ...) \
+	do { \
+		if (log_enabled(params, level)) { \
+			(params)->logger_msg((params)->logger_arg, __VA_ARGS__); \
+		} \
+	} while (0)
+
+#define log_error(params, ...) log_msg(params, LOG_LEVEL_ERROR, __VA_ARGS__)
+#define log_info(params, ...) log_msg(params, LOG_LEVEL_INFO, __VA_ARGS__)
+#define log_debug(params, ...) log_msg(params, LOG_LEVEL_DEBUG, __VA_ARGS__)
+
+/* build with -DRAW2FITS_NO_TRACE to remove trace messages from the binary */
+#ifdef RAW2FITS_NO_TRACE
+#define log_trace(params, ...) do { } while (0)
+#else
+#define log_trace(params, ...) log_msg(params, LOG_LEVEL_TRACE, __VA_ARGS__)
+#endif
+
+#endif
@@ -0,0 +1,56 @@
+/* 
+   pixel_kernels.h
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#ifndef __PIXEL_KERNELS_H__
+#define __PIXEL_KERNELS_H__
+
+#include <stddef.h>
+#include <stdint.h>
+
+/* integer channel weights with the precomputed reciprocal of their sum */
+typedef struct gray_weights {
+	uint16_t w[3];
+	uint32_t mul;
+	int shift;
+} gray_weights_t;
+
+int pixel_kernels_select(const char *name);
+const char *pixel_kernels_name();
+
+int gray_weights_init(gray_weights_t *gw, unsigned int red, unsigned int green, unsigned int blue);
+
+/* grayscale in the native order, float output converts it with u16_to_f32() */
+void rgb48_to_gray(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw);
+
+/* pixels are stored big-endian with BZERO = 32768 and written to the FITS as is */
+void deinterleave_rgb48_fits(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue, size_t pixels);
+void rgb48_to_gray_fits(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw);
+void extract_rgb48_red_fits(const uint16_t *src, uint16_t *dst, size_t pixels);
+void extract_rgb48_green_fits(const uint16_t *src, uint16_t *dst, size_t pixels);
+void extract_rgb48_blue_fits(const uint16_t *src, uint16_t *dst, size_t pixels);
+
+/* src and dst may be the same buffer */
+void u16_to_fits(const uint16_t *src, uint16_t *dst, size_t pixels);
+
+/* float output, every value is multiplied by scale, rgb48_to_f32() gives r * mul[0] + g * mul[1] + b * mul[2] */
+void deinterleave_rgb48_f32(const uint16_t *src, float *red, float *green, float *blue, size_t pixels, float scale);
+void rgb48_to_f32(const uint16_t *src, float *dst, size_t pixels, const float *mul);
+void u16_to_f32(const uint16_t *src, float *dst, size_t pixels, float scale);
+
+#endif
@@ -17,8 +17,46 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.  
  */
 
-#include "converter_types.h"
-
-void raw2fits(char *file, converter_params_t *params);
+#ifndef __RAW2FITS_H__
+#define __RAW2FITS_H__
 
+#include <stddef.h>
+#include <stdint.h>
+#include "converter_types.h"
+#include "frame_pool.h"
+
+#define RAW2FITS_MAX_PLANES 3
+
+/* one file passing through the read -> decode -> write stages */
+typedef struct raw2fits_job {
+	converter_params_t *params;
+	char *file;
+	void *rawbuf;
+	size_t rawbuf_size;
+	file_metadata_t meta;
+	char target_filename[512];
+	int width;
+	int height;
+	int bits;
+	int planes_count;
+	int binning;
+	char bayer_pattern[5];
+	void *planes[RAW2FITS_MAX_PLANES];
+	frame_buf_t *frames[RAW2FITS_MAX_PLANES];
+
+	/* optional, spare cores for the LibRaw threads of the dcraw processing */
+	int (*take_spare_cores)();
+	void (*release_spare_cores)(int cores);
+} raw2fits_job_t;
+
+/* FITS header cards which are the same for all files are made once, before the batch starts */
+void raw2fits_batch_init(converter_params_t *params);
+
+void raw2fits_job_init(raw2fits_job_t *job, converter_params_t *params, char *file);
+int raw2fits_read(raw2fits_job_t *job);
+int raw2fits_decode(raw2fits_job_t *job);
+int raw2fits_write(raw2fits_job_t *job);
+void raw2fits_release(raw2fits_job_t *job);
+
+#endif
 
@@ -20,14 +20,16 @@
 #ifndef __THREAD_POOL_H__
 #define __THREAD_POOL_H__
 
+#include <stddef.h>
+
 typedef void* (*thread_task) (void *arg);
+typedef void (*range_task) (void *arg, size_t index);
 
-void init_thread_pool(size_t num_threads);
-void thread_pool_add_task(thread_task task, void *task_arg);
+void init_thread_pool(size_t num_threads, int max_pending);
+void thread_pool_add_task(thread_task task, void *task_arg, long cost);
+void thread_pool_parallel_for(range_task task, void *task_arg, size_t count);
+int thread_pool_pending_tasks();
 void cleanup_thread_pool();
 
-void task_enter_critical_section();
-void task_exit_critical_section();
-
 #endif
 
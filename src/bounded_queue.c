@@ -0,0 +1,137 @@
+/* 
+   bounded_queue.c
+    - blocking FIFO queue with the limited capacity, connects conversion stages
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdlib.h>
+#include "bounded_queue.h"
+
+bounded_queue_t *bounded_queue_create(int capacity)
+{
+	bounded_queue_t *queue = (bounded_queue_t *) calloc(1, sizeof(bounded_queue_t));
+
+	if (!queue) {
+		return NULL;
+	}
+
+	queue->items = (void **) malloc(sizeof(void *) * capacity);
+
+	if (!queue->items) {
+		free(queue);
+		return NULL;
+	}
+
+	queue->capacity = capacity;
+
+	pthread_mutex_init(&queue->lock, NULL);
+	pthread_cond_init(&queue->not_empty, NULL);
+	pthread_cond_init(&queue->not_full, NULL);
+
+	return queue;
+}
+
+/* blocks while the queue is full, producer is slowed down to the consumer speed */
+int bounded_queue_push(bounded_queue_t *queue, void *item)
+{
+	pthread_mutex_lock(&queue->lock);
+
+	while (queue->count == queue->capacity && !queue->closed) {
+		pthread_cond_wait(&queue->not_full, &queue->lock);
+	}
+
+	if (queue->closed) {
+		pthread_mutex_unlock(&queue->lock);
+		return -1;
+	}
+
+	queue->items[(queue->head + queue->count) % queue->capacity] = item;
+	queue->count++;
+
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+
+	return 0;
+}
+
+/* doesn't wait, fails when the queue is full or closed */
+int bounded_queue_try_push(bounded_queue_t *queue, void *item)
+{
+	pthread_mutex_lock(&queue->lock);
+
+	if (queue->count == queue->capacity || queue->closed) {
+		pthread_mutex_unlock(&queue->lock);
+		return -1;
+	}
+
+	queue->items[(queue->head + queue->count) % queue->capacity] = item;
+	queue->count++;
+
+	pthread_cond_signal(&queue->not_empty);
+	pthread_mutex_unlock(&queue->lock);
+
+	return 0;
+}
+
+/* returns NULL only when the queue is closed and nothing is left */
+void *bounded_queue_pop(bounded_queue_t *queue)
+{
+	void *item = NULL;
+
+	pthread_mutex_lock(&queue->lock);
+
+	while (queue->count == 0 && !queue->closed) {
+		pthread_cond_wait(&queue->not_empty, &queue->lock);
+	}
+
+	if (queue->count > 0) {
+		item = queue->items[queue->head];
+		queue->head = (queue->head + 1) % queue->capacity;
+		queue->count--;
+
+		pthread_cond_signal(&queue->not_full);
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return item;
+}
+
+void bounded_queue_close(bounded_queue_t *queue)
+{
+	pthread_mutex_lock(&queue->lock);
+
+	queue->closed = 1;
+
+	pthread_cond_broadcast(&queue->not_empty);
+	pthread_cond_broadcast(&queue->not_full);
+	pthread_mutex_unlock(&queue->lock);
+}
+
+void bounded_queue_free(bounded_queue_t *queue)
+{
+	if (!queue) {
+		return;
+	}
+
+	pthread_cond_destroy(&queue->not_full);
+	pthread_cond_destroy(&queue->not_empty);
+	pthread_mutex_destroy(&queue->lock);
+
+	free(queue->items);
+	free(queue);
+}
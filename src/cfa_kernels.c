@@ -0,0 +1,280 @@
+/* 
+   cfa_kernels.c
+    - pixel loops over the raw Bayer mosaic
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include "cfa_kernels.h"
+
+#ifdef __GNUC__
+#define CFA_INLINE static inline __attribute__((always_inline))
+#else
+#define CFA_INLINE static inline
+#endif
+
+static inline uint16_t clamp_u16(uint32_t val)
+{
+	return val > UINT16_MAX ? UINT16_MAX : (uint16_t) val;
+}
+
+/* 
+   Kernels are inlined with the constant bin, so the block loops are unrolled
+   and the division of the mean is done by multiplication.
+   All rows of the block are walked together, every source pixel is read once.
+ */
+CFA_INLINE void bin_mono_rows(const cfa_image_t *cfa, const int bin, int sum,
+								uint16_t *dst, size_t first_row, size_t rows)
+{
+	size_t out_width = cfa->width / bin;
+	size_t out_height = cfa->height / bin;
+	const uint16_t *src[CFA_MAX_BINNING];
+	size_t row, col;
+	uint32_t acc;
+	int i;
+
+	for (row = first_row; row < first_row + rows; row++) {
+		for (i = 0; i < bin; i++) {
+			src[i] = cfa->data + ((out_height - 1 - row) * bin + i) * cfa->pitch;
+		}
+
+		for (col = 0; col < out_width; col++) {
+			acc = 0;
+
+			for (i = 0; i < bin * bin; i++) {
+				acc += src[i / bin][col * bin + i % bin];
+			}
+
+			dst[(row - first_row) * out_width + col] = sum ? clamp_u16(acc) : (uint16_t) ((acc + bin * bin / 2) / (bin * bin));
+		}
+	}
+}
+
+/* 
+   Every channel is the mean of its own sites in the block, the sum mode scales it to the whole block,
+   so 3x3 blocks with a different number of the sites of one colour give the comparable values.
+ */
+CFA_INLINE void bin_rgb_rows(const cfa_image_t *cfa, const int bin, int sum,
+								uint16_t **planes, size_t first_row, size_t rows)
+{
+	size_t out_width = cfa->width / bin;
+	size_t out_height = cfa->height / bin;
+	const uint16_t *src[CFA_MAX_BINNING];
+	uint32_t mask[2][3][CFA_MAX_BINNING * CFA_MAX_BINNING];
+	uint32_t count[2][3], acc[3], val;
+	uint64_t recip[2][3];
+	uint32_t scale = sum ? bin * bin : 1;
+	size_t row, col, y;
+	int i, j, c;
+
+	for (row = first_row; row < first_row + rows; row++) {
+		y = (out_height - 1 - row) * bin;
+
+		for (i = 0; i < bin; i++) {
+			src[i] = cfa->data + (y + i) * cfa->pitch;
+		}
+
+		/* sites of every colour in the blocks starting at even and odd column */
+		for (j = 0; j < 2; j++) {
+			for (c = 0; c < 3; c++) {
+				count[j][c] = 0;
+
+				for (i = 0; i < bin * bin; i++) {
+					mask[j][c][i] = cfa->color[(y + i / bin) & 1][(j * bin + i % bin) & 1] == c;
+					count[j][c] += mask[j][c][i];
+				}
+
+				/* exact for the scaled sums below 2^32 / bin^2 */
+				recip[j][c] = count[j][c] ? ((UINT64_C(1) << 32) + count[j][c] - 1) / count[j][c] : 0;
+			}
+		}
+
+		for (col = 0; col < out_width; col++) {
+			j = (col * bin) & 1;
+			acc[0] = acc[1] = acc[2] = 0;
+
+			/* masks instead of the colour lookups keep the sums in registers */
+			for (i = 0; i < bin * bin; i++) {
+				val = src[i / bin][col * bin + i % bin];
+
+				acc[0] += val * mask[j][0][i];
+				acc[1] += val * mask[j][1][i];
+				acc[2] += val * mask[j][2][i];
+			}
+
+			for (c = 0; c < 3; c++) {
+				if (planes[c]) {
+					planes[c][(row - first_row) * out_width + col] =
+						clamp_u16(((acc[c] * scale + count[j][c] / 2) * recip[j][c]) >> 32);
+				}
+			}
+		}
+	}
+}
+
+/* 2x2 blocks start at even row and column, so every block has the same layout: one red, two green and one blue */
+static void bin_rgb_2x2_rows(const cfa_image_t *cfa, int sum, uint16_t **planes, size_t first_row, size_t rows)
+{
+	size_t out_width = cfa->width / 2;
+	size_t out_height = cfa->height / 2;
+	const uint16_t *src0, *src1;
+	uint32_t site[4], red, green, blue;
+	int pos[4], count[3] = { 0, 0, 0 };
+	size_t row, col;
+	int i, c;
+
+	/* positions of the red, both green and the blue site in the block */
+	for (i = 0; i < 4; i++) {
+		c = cfa->color[i / 2][i % 2];
+		pos[c == 0 ? 0 : (c == 2 ? 3 : 1 + count[1])] = i;
+		count[c]++;
+	}
+
+	for (row = first_row; row < first_row + rows; row++) {
+		src0 = cfa->data + (out_height - 1 - row) * 2 * cfa->pitch;
+		src1 = src0 + cfa->pitch;
+
+		for (col = 0; col < out_width; col++) {
+			site[0] = src0[col * 2];
+			site[1] = src0[col * 2 + 1];
+			site[2] = src1[col * 2];
+			site[3] = src1[col * 2 + 1];
+
+			red = site[pos[0]];
+			green = site[pos[1]] + site[pos[2]];
+			blue = site[pos[3]];
+
+			if (sum) {
+				red = clamp_u16(red * 4);
+				green = clamp_u16(green * 2);
+				blue = clamp_u16(blue * 4);
+			} else {
+				green = (green + 1) >> 1;
+			}
+
+			if (planes[0]) {
+				planes[0][(row - first_row) * out_width + col] = (uint16_t) red;
+			}
+
+			if (planes[1]) {
+				planes[1][(row - first_row) * out_width + col] = (uint16_t) green;
+			}
+
+			if (planes[2]) {
+				planes[2][(row - first_row) * out_width + col] = (uint16_t) blue;
+			}
+		}
+	}
+}
+
+void cfa_bin_mono(const cfa_image_t *cfa, int bin, int sum, uint16_t *dst, size_t first_row, size_t rows)
+{
+	if (bin == 2) {
+		bin_mono_rows(cfa, 2, sum, dst, first_row, rows);
+	} else if (bin == 3) {
+		bin_mono_rows(cfa, 3, sum, dst, first_row, rows);
+	}
+}
+
+void cfa_bin_rgb(const cfa_image_t *cfa, int bin, int sum, uint16_t **planes, size_t first_row, size_t rows)
+{
+	if (bin == 2) {
+		bin_rgb_2x2_rows(cfa, sum, planes, first_row, rows);
+	} else if (bin == 3) {
+		bin_rgb_rows(cfa, 3, sum, planes, first_row, rows);
+	}
+}
+
+enum {
+	SITE_OWN = 0,
+	SITE_HORIZONTAL,
+	SITE_VERTICAL,
+	SITE_CROSS,
+	SITE_DIAGONAL
+};
+
+/* neighbours of the channel around every site of the 2x2 cell */
+static int site_kind(const cfa_image_t *cfa, int channel, int row, int col)
+{
+	if (cfa->color[row][col] == channel) {
+		return SITE_OWN;
+	}
+
+	if (cfa->color[row][col ^ 1] == channel) {
+		return cfa->color[row ^ 1][col] == channel ? SITE_CROSS : SITE_HORIZONTAL;
+	}
+
+	return cfa->color[row ^ 1][col] == channel ? SITE_VERTICAL : SITE_DIAGONAL;
+}
+
+/* 
+   Mean of the nearest sites of the channel, borders are mirrored by two pixels
+   so the mirrored site has the same colour.
+ */
+static inline uint16_t interpolate_site(const uint16_t *up, const uint16_t *mid, const uint16_t *down,
+											int kind, size_t left, size_t col, size_t right)
+{
+	switch (kind) {
+		case SITE_HORIZONTAL:
+			return (mid[left] + mid[right] + 1) >> 1;
+
+		case SITE_VERTICAL:
+			return (up[col] + down[col] + 1) >> 1;
+
+		case SITE_CROSS:
+			return (mid[left] + mid[right] + up[col] + down[col] + 2) >> 2;
+
+		case SITE_DIAGONAL:
+			return (up[left] + up[right] + down[left] + down[right] + 2) >> 2;
+
+		default:
+			return mid[col];
+	}
+}
+
+void cfa_interpolate(const cfa_image_t *cfa, int channel, uint16_t *dst, size_t first_row, size_t rows)
+{
+	const uint16_t *up, *mid, *down;
+	uint16_t *out;
+	size_t row, col, y, width = cfa->width;
+	int kind[2];
+
+	for (row = first_row; row < first_row + rows; row++) {
+		y = cfa->height - 1 - row;
+
+		mid = cfa->data + y * cfa->pitch;
+		up = cfa->data + (y > 0 ? y - 1 : y + 1) * cfa->pitch;
+		down = cfa->data + (y + 1 < cfa->height ? y + 1 : y - 1) * cfa->pitch;
+		out = dst + (row - first_row) * width;
+
+		kind[0] = site_kind(cfa, channel, y & 1, 0);
+		kind[1] = site_kind(cfa, channel, y & 1, 1);
+
+		out[0] = interpolate_site(up, mid, down, kind[0], 1, 0, 1);
+
+		/* interior of the row, kind of the site alternates */
+		for (col = 1; col + 1 < width; col += 2) {
+			out[col] = interpolate_site(up, mid, down, kind[1], col - 1, col, col + 1);
+
+			if (col + 2 < width) {
+				out[col + 1] = interpolate_site(up, mid, down, kind[0], col, col + 1, col + 2);
+			}
+		}
+
+		col = width - 1;
+		out[col] = interpolate_site(up, mid, down, kind[col & 1], col - 1, col, col - 1);
+	}
+}
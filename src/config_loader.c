@@ -31,7 +31,34 @@ static const char *color_mode_dump_desc[] =
 	"R, G and B channels to the one FITS with separate headers",
 	"Only R channel",
 	"Only G channel",
-	"Only B channel"
+	"Only B channel",
+	"Raw CFA mosaic without debayering"
+};
+
+static const char *cfa_channels_dump_desc[] =
+{
+	"No, debayer the image",
+	"Half resolution",
+	"Full resolution, interpolated"
+};
+
+static const char *normalize_dump_desc[] =
+{
+	"No",
+	"To the [0, 1] range",
+	"By the exposure time"
+};
+
+static const char *schedule_dump_desc[] =
+{
+	"Directory order",
+	"Largest files first"
+};
+
+static const char *fits_backend_dump_desc[] =
+{
+	"cfitsio",
+	"Native"
 };
 
 static const char *out_filenaming_dump_des[] =
@@ -102,6 +129,17 @@ int load_configuration_io_filenaming(config_setting_t *setting, converter_params
 	return 0;
 }
 
+void load_configuration_io_recursive(config_setting_t *setting, converter_params_t *conv_params)
+{
+	int val;
+
+	conv_params->fsetup.recursive = 0;
+
+	if (config_setting_lookup_bool(setting, "recursive", &val)) {
+		conv_params->fsetup.recursive = (char) val;
+	}
+}
+
 float load_float_value_anyway(config_setting_t *setting, char *fieldname)
 {
 	double fval = 0;
@@ -218,8 +256,8 @@ int load_image_colors_options(config_setting_t *setting, converter_params_t *con
 		return -1;
 	}
 
-	if (val < 0 || val > 5) {
-		printf("Invalid raw2fits.colors.mode value = %i, possible range is 0-5\n", val);
+	if (val < 0 || val > 6) {
+		printf("Invalid raw2fits.colors.mode value = %i, possible range is 0-6\n", val);
 		return -1;
 	}
 
@@ -246,6 +284,86 @@ int load_image_colors_options(config_setting_t *setting, converter_params_t *con
 
 	conv_params->imsetup.apply_autoscale = (char) val;
 
+	/* binning is optional, frames are not binned by default */
+	conv_params->imsetup.binning = 1;
+	conv_params->imsetup.binning_sum = 0;
+
+	if (config_setting_lookup_int(setting, "binning", &val)) {
+		if (val < 1 || val > 3) {
+			printf("Invalid raw2fits.colors.binning value = %i, possible range is 1-3\n", val);
+			return -1;
+		}
+
+		conv_params->imsetup.binning = val;
+	}
+
+	if (config_setting_lookup_bool(setting, "binning_sum", &val)) {
+		conv_params->imsetup.binning_sum = (char) val;
+	}
+
+	conv_params->imsetup.cfa_channels = CFA_CHANNELS_DEBAYER;
+
+	if (config_setting_lookup_int(setting, "cfa_channels", &val)) {
+		if (val < 0 || val > 2) {
+			printf("Invalid raw2fits.colors.cfa_channels value = %i, possible range is 0-2\n", val);
+			return -1;
+		}
+
+		conv_params->imsetup.cfa_channels = val;
+	}
+
+	/* 16-bit integer output by default, float output may be normalized */
+	conv_params->imsetup.bitpix = 16;
+	conv_params->imsetup.normalize = NORMALIZE_NONE;
+
+	if (config_setting_lookup_int(setting, "bitpix", &val)) {
+		if (val != 16 && val != -32) {
+			printf("Invalid raw2fits.colors.bitpix value = %i, possible values are 16 and -32\n", val);
+			return -1;
+		}
+
+		conv_params->imsetup.bitpix = val;
+	}
+
+	if (config_setting_lookup_int(setting, "normalize", &val)) {
+		if (val < 0 || val > 2) {
+			printf("Invalid raw2fits.colors.normalize value = %i, possible range is 0-2\n", val);
+			return -1;
+		}
+
+		if (val != NORMALIZE_NONE && conv_params->imsetup.bitpix != -32) {
+			printf("raw2fits.colors.normalize requires bitpix = -32\n");
+			return -1;
+		}
+
+		conv_params->imsetup.normalize = val;
+	}
+
+	return 0;
+}
+
+int load_performance_options(config_setting_t *setting, converter_params_t *conv_params)
+{
+	int val;
+
+	if (config_setting_lookup_int(setting, "schedule", &val)) {
+		if (val < 0 || val > 1) {
+			printf("Invalid raw2fits.performance.schedule value = %i, possible range is 0-1\n", val);
+			return -1;
+		}
+
+		conv_params->schedule = val;
+	}
+
+	if (config_setting_lookup_int(setting, "fits_writer", &val)) {
+		if (val < 0 || val > 1) {
+			printf("Invalid raw2fits.performance.fits_writer value = %i, possible range is 0-1\n", val);
+			return -1;
+		}
+
+		conv_params->fits_backend = val;
+	}
+
 	return 0;
 }
 
@@ -288,6 +406,8 @@ int load_configuration(char *confile, converter_params_t *conv_params)
 		return (EXIT_FAILURE);
 	}
 
+	load_configuration_io_recursive(setting, conv_params);
+
 	setting = config_lookup(&cfg, "raw2fits.io.raw_filter_name");
 
 	if (setting) {
@@ -344,6 +464,16 @@ int load_configuration(char *confile, converter_params_t *conv_params)
 		return (EXIT_FAILURE);
 	}
 
+	conv_params->schedule = SCHEDULE_LARGEST_FIRST;
+	conv_params->fits_backend = FITS_BACKEND_CFITSIO;
+
+	setting = config_lookup(&cfg, "raw2fits.performance");
+
+	if (setting && load_performance_options(setting, conv_params) < 0) {
+		config_destroy(&cfg);
+		return (EXIT_FAILURE);
+	}
+
 	config_destroy(&cfg);
 
 	return 0;
@@ -395,11 +525,22 @@ void dump_configuration(converter_params_t *conv_params)
 	printf("Apply autobright by histogram: %s\n", (conv_params->imsetup.apply_auto_bright ? "Yes" : "No"));
 	printf("Apply pixels interpolation: %s\n", (conv_params->imsetup.apply_interpolation ? "Yes" : "No"));
 	printf("Apply pixels autoscale: %s\n", (conv_params->imsetup.apply_autoscale ? "Yes" : "No"));
+	printf("Binning: %ix%i%s\n", conv_params->imsetup.binning, conv_params->imsetup.binning,
+			(conv_params->imsetup.binning > 1 ? (conv_params->imsetup.binning_sum ? ", sum" : ", mean") : ""));
+	printf("Channels from the raw mosaic: %i (%s)\n", conv_params->imsetup.cfa_channels,
+											cfa_channels_dump_desc[conv_params->imsetup.cfa_channels]);
+	printf("BITPIX: %i\n", conv_params->imsetup.bitpix);
+	printf("Normalize: %i (%s)\n", conv_params->imsetup.normalize, normalize_dump_desc[conv_params->imsetup.normalize]);
 
 
 	printf("\nOutput options:\n");
 	printf("Mode: %i (%s)\n", conv_params->fsetup.naming, out_filenaming_dump_des[conv_params->fsetup.naming]);
 	printf("Overwrite existing files: %s\n", (conv_params->fsetup.overwrite ? "Yes" : "No"));
+	printf("Scan subdirectories: %s\n", (conv_params->fsetup.recursive ? "Yes" : "No"));
+
+	printf("\nPerformance options:\n");
+	printf("Schedule: %i (%s)\n", conv_params->schedule, schedule_dump_desc[conv_params->schedule]);
+	printf("FITS writer: %i (%s)\n", conv_params->fits_backend, fits_backend_dump_desc[conv_params->fits_backend]);
 
 	printf("\nEnd of configuration\n\n");
 }
@@ -22,158 +22,556 @@
 #include <dirent.h>
 #include <string.h>
 #include <unistd.h>
+#include <fcntl.h>
+#include <time.h>
+#include <pthread.h>
+#include <sys/stat.h>
 #include "list.h"
+#include "bounded_queue.h"
 #include "converter.h"
 #include "file_utils.h"
 #include "thread_pool.h"
 #include "raw2fits.h"
+#include "logger.h"
+#include "frame_pool.h"
+#include "pixel_kernels.h"
 
-static list_node_t *file_list = NULL;
+#define PROGRESS_UPDATES_PER_SEC 10
+#define SCAN_THREADS 4
+#define SCAN_QUEUE_SIZE 64
+
+static file_list_t *file_list = NULL;
 static int total_files_counter = 0;
+static int scanned_files_count = 0;
+
+static pthread_t scanner_thread;
+static char scanner_started = 0;
+static bounded_queue_t *scan_queue = NULL;
+static pthread_mutex_t scan_lock = PTHREAD_MUTEX_INITIALIZER;
+static file_list_t *scan_subdirs = NULL;
+
+static int files_done = 0;
+static long bytes_done = 0;
+static double batch_start_ns = 0;
+static long long last_progress_ns = 0;
+static pthread_mutex_t progress_lock = PTHREAD_MUTEX_INITIALIZER;
+
+static pthread_t reader_thread;
+static char reader_started = 0;
+
+static pthread_t *writer_threads = NULL;
+static int total_writers = 0;
+static bounded_queue_t *write_queue = NULL;
 
 typedef struct thread_arg {
-	converter_params_t *conv_param;
-	list_node_t *filelist;
-	int file_list_offset;
-	int file_list_len;
+	raw2fits_job_t job;
+	file_entry_t *entry;
+	long file_size;
+	int vendor_id;
+	double decode_ns;
 } thread_arg_t;
 
-void convert_one_file(char *file, void *arg)
+/* measured decoding speed, kept between the batches */
+typedef struct vendor_cost {
+	long long decode_ns;
+	long long bytes;
+} vendor_cost_t;
+
+static vendor_cost_t vendor_costs[MAX_FILE_VENDORS];
+
+/* core budget shared by the file decoders and LibRaw threads inside them */
+static int free_cores = 0;
+static int busy_decoders = 0;
+
+/* every decoder holds one core while the file is decoded */
+static void enter_decoder()
 {
-	converter_params_t *params = (converter_params_t *) arg;
+	__atomic_add_fetch(&busy_decoders, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&free_cores, 1, __ATOMIC_RELAXED);
+}
+
+static void leave_decoder()
+{
+	__atomic_add_fetch(&free_cores, 1, __ATOMIC_RELAXED);
+	__atomic_sub_fetch(&busy_decoders, 1, __ATOMIC_RELAXED);
+}
+
+/* 
+   Only the dcraw processing runs LibRaw threads and asks for the spare cores.
+   While files are waiting in the queue the cores are left for them, otherwise (single file, batch tail)
+   decoder takes its share of the idle cores. Cores are returned when the processing is done.
+ */
+static int take_spare_cores()
+{
+	int spare, share, busy;
+
+	if (thread_pool_pending_tasks() > 0) {
+		return 0;
+	}
+
+	busy = __atomic_load_n(&busy_decoders, __ATOMIC_RELAXED);
+	spare = __atomic_load_n(&free_cores, __ATOMIC_RELAXED);
+
+	do {
+		if (spare <= 0) {
+			return 0;
+		}
+
+		share = spare / busy > 0 ? spare / busy : 1;
+	} while (!__atomic_compare_exchange_n(&free_cores, &spare, spare - share, 0, __ATOMIC_RELAXED, __ATOMIC_RELAXED));
+
+	return share;
+}
+
+static void release_spare_cores(int cores)
+{
+	__atomic_add_fetch(&free_cores, cores, __ATOMIC_RELAXED);
+}
+
+static long estimate_file_cost(file_info_t *finfo)
+{
+	int i;
+	long long vendor_ns, vendor_bytes;
+	double ns_per_byte = 0, total_ns = 0, total_bytes = 0;
+
+	/* costs may be updated by the converter while the directory is still scanned */
+	vendor_ns = __atomic_load_n(&vendor_costs[finfo->vendor_id].decode_ns, __ATOMIC_RELAXED);
+	vendor_bytes = __atomic_load_n(&vendor_costs[finfo->vendor_id].bytes, __ATOMIC_RELAXED);
+
+	if (vendor_bytes > 0) {
+		ns_per_byte = (double) vendor_ns / vendor_bytes;
+	} else {
+		for (i = 0; i < MAX_FILE_VENDORS; i++) {
+			total_ns += __atomic_load_n(&vendor_costs[i].decode_ns, __ATOMIC_RELAXED);
+			total_bytes += __atomic_load_n(&vendor_costs[i].bytes, __ATOMIC_RELAXED);
+		}
+
+		ns_per_byte = total_bytes > 0 ? total_ns / total_bytes : 1.0;
+	}
+
+	return (long) (finfo->file_size * ns_per_byte);
+}
+
+static double get_time_ns()
+{
+	struct timespec ts;
+
+	clock_gettime(CLOCK_MONOTONIC, &ts);
+
+	return ts.tv_sec * 1e9 + ts.tv_nsec;
+}
 
-	params->logger_msg(params->logger_arg, "\nWorking %s\n", file);
+/* 
+   Progress is reported no more than PROGRESS_UPDATES_PER_SEC times,
+   thread which comes while another one is reporting just skips the update.
+   The last file is always reported.
+ */
+static void notify_progress(converter_params_t *params, int force)
+{
+	progress_stats_t stats;
+	double now_ns = get_time_ns();
+	double elapsed_sec;
+
+	if (!force && now_ns - __atomic_load_n(&last_progress_ns, __ATOMIC_RELAXED) < 1e9 / PROGRESS_UPDATES_PER_SEC) {
+		return;
+	}
+
+	if (force) {
+		pthread_mutex_lock(&progress_lock);
+	} else if (pthread_mutex_trylock(&progress_lock) != 0) {
+		return;
+	}
 
-	raw2fits(file, params);
+	__atomic_store_n(&last_progress_ns, (long long) now_ns, __ATOMIC_RELAXED);
 
-	params->progress.progr_update(&params->progress);
+	stats.files_done = __atomic_load_n(&files_done, __ATOMIC_ACQUIRE);
+	stats.files_total = __atomic_load_n(&scanned_files_count, __ATOMIC_RELAXED);
+	stats.bytes_done = __atomic_load_n(&bytes_done, __ATOMIC_RELAXED);
 
-	task_enter_critical_section();
+	elapsed_sec = (now_ns - batch_start_ns) / 1e9;
+	stats.rate = elapsed_sec > 0 ? stats.files_done / elapsed_sec : 0;
 
-	total_files_counter--;
+	params->progress.progr_update(&params->progress, &stats);
 
-	if (total_files_counter == 0) {
+	pthread_mutex_unlock(&progress_lock);
+}
+
+/* 
+   Batch is complete when all files and the scanner released own references,
+   so the fast converter never completes the batch while the directory is still scanned.
+ */
+static void batch_unref(converter_params_t *params)
+{
+	int last_ref = __atomic_sub_fetch(&total_files_counter, 1, __ATOMIC_ACQ_REL) == 0;
+
+	if (params->converter_run && __atomic_load_n(&files_done, __ATOMIC_RELAXED) > 0) {
+		notify_progress(params, last_ref);
+	}
+
+	if (last_ref) {
 		params->complete(params->done_arg);
 	}
+}
+
+static void finish_one_file(thread_arg_t *th_arg)
+{
+	converter_params_t *params = th_arg->job.params;
+
+	raw2fits_release(&th_arg->job);
+
+	if (th_arg->decode_ns > 0 && th_arg->file_size > 0) {
+		__atomic_add_fetch(&vendor_costs[th_arg->vendor_id].decode_ns, (long long) th_arg->decode_ns, __ATOMIC_RELAXED);
+		__atomic_add_fetch(&vendor_costs[th_arg->vendor_id].bytes, th_arg->file_size, __ATOMIC_RELAXED);
+	}
+
+	__atomic_add_fetch(&bytes_done, th_arg->file_size, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&files_done, 1, __ATOMIC_RELEASE);
+
+	if (th_arg->entry->state != FILE_FAILED) {
+		th_arg->entry->state = FILE_DONE;
+	}
 
-	task_exit_critical_section();
+	free(th_arg);
+
+	batch_unref(params);
 }
 
-void *thread_func(void *arg)
+/* decoding stage, executed by the threads pool */
+void *decode_func(void *arg)
 {
-	thread_arg_t th_arg_local;
 	thread_arg_t *th_arg = (thread_arg_t *) arg;
-	converter_params_t *params;
+	converter_params_t *params = th_arg->job.params;
+	double start_ns;
+	int err;
 
-	memcpy(&th_arg_local, th_arg, sizeof(thread_arg_t));
+	if (!params->converter_run) {
+		finish_one_file(th_arg);
+		return NULL;
+	}
 
-	free(th_arg);
+	log_info(params, "\nWorking %s\n", th_arg->job.file);
+
+	start_ns = get_time_ns();
+
+	enter_decoder();
 
-	params = th_arg_local.conv_param;
+	err = raw2fits_decode(&th_arg->job);
 
-	iterate_list_cb(th_arg_local.filelist, &convert_one_file, params, th_arg_local.file_list_offset, th_arg_local.file_list_len, &params->converter_run);
+	leave_decoder();
+
+	if (err == 0) {
+		th_arg->decode_ns = get_time_ns() - start_ns;
+	} else {
+		th_arg->entry->state = FILE_FAILED;
+	}
+
+	if (err != 0 || bounded_queue_push(write_queue, th_arg) != 0) {
+		finish_one_file(th_arg);
+	}
 
 	return NULL;
 }
 
-void convert_files(converter_params_t *params)
+/* reading stage, feeds the decoders in the scheduled order */
+void read_one_file(file_entry_t *entry, void *arg)
+{
+	thread_arg_t *th_arg = (thread_arg_t*) calloc(1, sizeof(thread_arg_t));
+
+	raw2fits_job_init(&th_arg->job, (converter_params_t *) arg, entry->path);
+
+	th_arg->job.take_spare_cores = take_spare_cores;
+	th_arg->job.release_spare_cores = release_spare_cores;
+	th_arg->entry = entry;
+	th_arg->file_size = entry->size;
+	th_arg->vendor_id = entry->tag;
+
+	if (raw2fits_read(&th_arg->job) != 0) {
+		entry->state = FILE_FAILED;
+		finish_one_file(th_arg);
+		return;
+	}
+
+	/* blocks when the decoders are behind */
+	thread_pool_add_task(decode_func, th_arg, entry->weight);
+}
+
+void *reader_func(void *arg)
+{
+	converter_params_t *params = (converter_params_t *) arg;
+	void *item;
+
+	/* queue is drained to the end, so the scanner is never blocked after the stop */
+	while ((item = bounded_queue_pop(scan_queue))) {
+		if (params->converter_run) {
+			read_one_file(file_list_get(file_list, (int) (long) item - 1), params);
+		}
+	}
+
+	return NULL;
+}
+
+/* writing stage, drains decoded frames to the FITS files */
+void *writer_func(void *arg)
+{
+	thread_arg_t *th_arg;
+
+	while ((th_arg = (thread_arg_t *) bounded_queue_pop(write_queue))) {
+		if (th_arg->job.params->converter_run) {
+			raw2fits_write(&th_arg->job);
+		}
+
+		finish_one_file(th_arg);
+	}
+
+	return NULL;
+}
+
+/* 
+   Queue passes entry index + 1, NULL means the end of the scan.
+   Without wait file is queued only when the reader has a free slot.
+ */
+static int queue_file(int index, int wait)
+{
+	file_entry_t *entry = file_list_get(file_list, index);
+	void *item = (void *) (long) (index + 1);
+
+	/* state and reference are set first, the reader may finish with the file before the push returns */
+	entry->state = FILE_QUEUED;
+
+	__atomic_add_fetch(&total_files_counter, 1, __ATOMIC_ACQ_REL);
+
+	if (wait ? bounded_queue_push(scan_queue, item) : bounded_queue_try_push(scan_queue, item)) {
+		/* scanner still holds own reference, so this one is never the last */
+		__atomic_sub_fetch(&total_files_counter, 1, __ATOMIC_ACQ_REL);
+		entry->state = FILE_FOUND;
+		return -1;
+	}
+
+	return 0;
+}
+
+static void add_found_file(converter_params_t *params, char *full_path, file_info_t *finfo)
+{
+	int index;
+
+	pthread_mutex_lock(&scan_lock);
+
+	index = file_list_add(file_list, full_path, finfo->file_size,
+							estimate_file_cost(finfo), finfo->vendor_id);
+
+	pthread_mutex_unlock(&scan_lock);
+
+	if (index < 0) {
+		log_error(params, "Too many files, %s is skipped\n", full_path);
+		return;
+	}
+
+	__atomic_add_fetch(&scanned_files_count, 1, __ATOMIC_RELAXED);
+
+	log_debug(params, " Found %s raw file %s  size: %liK\n",
+						finfo->file_vendor, full_path, finfo->file_size / 1024);
+
+	/* 
+	   Files are streamed to the converter while it is waiting for them,
+	   the pool puts the expensive ones first. With the largest first schedule
+	   files found while the reader is busy are left for the sorted queueing after the scan.
+	 */
+	queue_file(index, params->schedule == SCHEDULE_READDIR);
+}
+
+/* 
+   d_type and fstatat() relative to the opened directory are used,
+   so only RAW files cost a stat() call and only they need the full path.
+   Subdirectories are scanned right away, or left in the subdirs list for the parallel scan.
+ */
+static void scan_directory(converter_params_t *params, char *path, file_list_t *subdirs)
 {
-	int file_count = 0;
 	DIR *dp;
 	struct dirent *ep;
-	long int cpucnt;
-	int files_per_cpu_int, left_files, i;
-	int file_list_offset_next = 0;
-	thread_arg_t *thread_params;
+	struct stat st;
+	file_info_t finfo;
+	size_t path_len = strlen(path);
+	size_t fname_len;
+	char *full_path;
+	int is_dir;
 
-	params->logger_msg(params->logger_arg, "Reading directory %s\n", params->inpath);
-
-	dp = opendir(params->inpath);
+	dp = opendir(path);
 
 	if (dp == NULL) {
+		log_error(params, "Unable to read directory %s\n", path);
 		return;
 	}
 
-	if (file_list) {
-		free_list(file_list);
-		file_list = NULL;
-	}	
+	while (params->converter_run && (ep = readdir(dp))) {
+		if (ep->d_name[0] == '.') {
+			continue;
+		}
+
+		is_dir = ep->d_type == DT_DIR;
+
+		if (!is_dir) {
+			get_file_vendor(ep->d_name, &finfo);
+
+			/* some filesystems don't fill d_type, only stat() tells if it's a directory */
+			if (!finfo.file_supported && !(ep->d_type == DT_UNKNOWN && params->fsetup.recursive)) {
+				continue;
+			}
+
+			if (fstatat(dirfd(dp), ep->d_name, &st, 0) < 0) {
+				continue;
+			}
 
-	while ((ep = readdir(dp))) {
-		size_t inpath_len = strlen(params->inpath);
-		size_t fname_len = strlen(ep->d_name);
-		char *full_path = (char *) malloc(inpath_len + fname_len + 2);
+			is_dir = S_ISDIR(st.st_mode);
 
-		strncpy(full_path, params->inpath, inpath_len);
-		full_path[inpath_len] = '/';
-		strncpy(full_path + inpath_len + 1, ep->d_name, fname_len);
-		full_path[inpath_len + fname_len + 1] = '\0';
+			if (!is_dir && (!finfo.file_supported || !S_ISREG(st.st_mode))) {
+				continue;
+			}
 
-		file_info_t finfo;
-		get_file_info(full_path, &finfo);
+			finfo.file_size = st.st_size;
+		}
 
-		if (!finfo.file_supported) {
-			free(full_path);
+		if (is_dir && !params->fsetup.recursive) {
 			continue;
 		}
 
-		params->logger_msg(params->logger_arg, " Found %s raw file %s  size: %liK\n",
-							finfo.file_vendor, ep->d_name, finfo.file_size / 1024);
-	
-		file_list = add_object_to_list(file_list, full_path);
+		fname_len = strlen(ep->d_name);
+		full_path = (char *) malloc(path_len + fname_len + 2);
+
+		memcpy(full_path, path, path_len);
+		full_path[path_len] = '/';
+		memcpy(full_path + path_len + 1, ep->d_name, fname_len + 1);
+
+		if (!is_dir) {
+			add_found_file(params, full_path, &finfo);
+		} else if (subdirs) {
+			file_list_add(subdirs, full_path, 0, 0, 0);
+		} else {
+			scan_directory(params, full_path, NULL);
+		}
 
 		free(full_path);
+	}
+
+	closedir(dp);
+}
 
-		file_count++;
+static void *subdir_scanner_func(void *arg)
+{
+	converter_params_t *params = (converter_params_t *) arg;
+	int index;
+
+	while ((index = file_list_claim(scan_subdirs)) >= 0) {
+		scan_directory(params, file_list_get(scan_subdirs, index)->path, NULL);
 	}
 
-	closedir (dp);
+	return NULL;
+}
 
-	if (file_count == 0) {
-		params->logger_msg(params->logger_arg, "Can't find RAW files, sorry\n");
-		free_list(file_list);
-		file_list = NULL;
-		return;
+static void *scanner_func(void *arg)
+{
+	converter_params_t *params = (converter_params_t *) arg;
+	pthread_t subdir_threads[SCAN_THREADS];
+	int i, threads_count, *order;
+
+	log_info(params, "Reading directory %s\n", params->inpath);
+
+	scan_subdirs = file_list_create();
+
+	scan_directory(params, params->inpath, scan_subdirs);
+
+	threads_count = scan_subdirs->count < SCAN_THREADS ? scan_subdirs->count : SCAN_THREADS;
+
+	/* night subdirectories are scanned in parallel, they are on the different disks often */
+	for (i = 0; i < threads_count; i++) {
+		pthread_create(&subdir_threads[i], NULL, subdir_scanner_func, params);
+	}
+
+	for (i = 0; i < threads_count; i++) {
+		pthread_join(subdir_threads[i], NULL);
+	}
+
+	file_list_free(scan_subdirs);
+	scan_subdirs = NULL;
+
+	if (scanned_files_count == 0) {
+		log_error(params, "Can't find RAW files, sorry\n");
+	} else {
+		log_info(params, "Total files to convert: %i\n", scanned_files_count);
 	}
 
-	params->progress.progr_setup(&params->progress, file_count);
+	if (params->schedule == SCHEDULE_LARGEST_FIRST && params->converter_run) {
+		order = file_list_sort_by_weight(file_list);
+
+		for (i = 0; order && i < file_list->count; i++) {
+			if (file_list_get(file_list, order[i])->state == FILE_FOUND) {
+				queue_file(order[i], 1);
+			}
+		}
+
+		free(order);
+	}
+
+	bounded_queue_close(scan_queue);
+
+	batch_unref(params);
+
+	return NULL;
+}
+
+void convert_files(converter_params_t *params)
+{
+	long int cpucnt;
+	int i;
+
+	converter_cleanup();
+
+	params->progress.progr_setup(&params->progress, 0);
 
 	cpucnt = sysconf(_SC_NPROCESSORS_ONLN);
 
-	params->logger_msg(params->logger_arg, "\nStarting conveter on %li processor cores...\n", cpucnt);
+	log_info(params, "\nStarting conveter on %li processor cores...\n", cpucnt);
 
-	if (cpucnt > file_count) {
-		files_per_cpu_int = 1;
-		left_files = 0;
-	} else {
-		files_per_cpu_int = file_count / cpucnt;
-		left_files = file_count % cpucnt;
+	/* kernel override is checked by the caller, unsupported one falls back to the best available */
+	if (pixel_kernels_select(params->kernel) != 0) {
+		pixel_kernels_select(NULL);
 	}
 
-	params->logger_msg(params->logger_arg, "Total files to convert: %i\n", file_count);
-	params->logger_msg(params->logger_arg, "Files per CPU core: %i, left: %i\n", files_per_cpu_int, left_files);
+	log_info(params, "Using %s pixel kernels\n", pixel_kernels_name());
 
-	total_files_counter = file_count;
+	raw2fits_batch_init(params);
 
-	init_thread_pool(cpucnt);
-	
-	for (i = 0; i < cpucnt; i++) {
-		thread_params = (thread_arg_t*) malloc(sizeof(thread_arg_t));
+	/* scanner holds one reference until the whole directory is read */
+	total_files_counter = 1;
+	scanned_files_count = 0;
 
-		thread_params->conv_param = params;
-		thread_params->filelist = file_list;
+	files_done = 0;
+	bytes_done = 0;
 
-		thread_params->file_list_offset = file_list_offset_next;
-		thread_params->file_list_len = files_per_cpu_int;
+	free_cores = cpucnt;
+	busy_decoders = 0;
+	batch_start_ns = get_time_ns();
+	last_progress_ns = 0;
 
-		if (i == cpucnt - 1) {
-			thread_params->file_list_len += left_files;
-		}
- 
-		thread_pool_add_task(thread_func, thread_params);
+	/* decoders: one per core, reader keeps a few files in advance */
+	init_thread_pool(cpucnt, cpucnt / 2 + 1);
+
+	/* writers: decoded frames wait in the queue no more than two per writer */
+	total_writers = cpucnt / 8 + 1;
+	write_queue = bounded_queue_create(total_writers * 2);
+	writer_threads = (pthread_t *) malloc(sizeof(pthread_t) * total_writers);
 
-		file_list_offset_next += files_per_cpu_int;
+	for (i = 0; i < total_writers; i++) {
+		pthread_create(&writer_threads[i], NULL, writer_func, NULL);
 	}
+
+	file_list = file_list_create();
+	scan_queue = bounded_queue_create(SCAN_QUEUE_SIZE);
+
+	pthread_create(&reader_thread, NULL, reader_func, params);
+	reader_started = 1;
+
+	pthread_create(&scanner_thread, NULL, scanner_func, params);
+	scanner_started = 1;
 }
 
 void converter_stop(converter_params_t *params)
@@ -185,11 +583,45 @@ void converter_stop(converter_params_t *params)
 
 void converter_cleanup()
 {
+	int i;
+
+	/* stages are stopped in the data flow order, every stage drains own queue */
+	if (scanner_started) {
+		pthread_join(scanner_thread, NULL);
+		scanner_started = 0;
+	}
+
+	if (reader_started) {
+		pthread_join(reader_thread, NULL);
+		reader_started = 0;
+	}
+
+	if (scan_queue) {
+		bounded_queue_free(scan_queue);
+		scan_queue = NULL;
+	}
+
 	cleanup_thread_pool();
 
+	if (write_queue) {
+		bounded_queue_close(write_queue);
+
+		for (i = 0; i < total_writers; i++) {
+			pthread_join(writer_threads[i], NULL);
+		}
+
+		free(writer_threads);
+		writer_threads = NULL;
+		total_writers = 0;
+
+		bounded_queue_free(write_queue);
+		write_queue = NULL;
+	}
+
 	if (file_list) {
-		free_list(file_list);
+		file_list_free(file_list);
 		file_list = NULL;
 	}
-}
 
+	frame_pool_cleanup();
+}
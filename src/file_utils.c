@@ -69,7 +69,8 @@ static struct file_vendors all_vendors[] =
 	}
 };
 
-void get_file_info(char *fname, file_info_t *finf)
+/* detects vendor by the file extension only, file size is not touched */
+void get_file_vendor(char *fname, file_info_t *finf)
 {
 	size_t fname_len = strlen(fname);
 	size_t il, vc;
@@ -96,31 +97,20 @@ void get_file_info(char *fname, file_info_t *finf)
 		if (strstr(file_extension, all_vendors[vc].extensions) != NULL) {
 			finf->file_supported = 1;
 			strcpy(finf->file_vendor, all_vendors[vc].vendor);
-			finf->file_size = get_file_size(fname);
+			finf->vendor_id = vc;
 		}
 	}
 
 	free(lowcase_buf);
 }
 
-long get_file_size(char *fname)
-{
-	struct stat statbuf;
-
-	if (stat(fname, &statbuf) < 0) {
-		return 0;
-	}
-
-	return statbuf.st_size;
-}
-
 int is_file_exist(char *filename)
 {
 	struct stat buffer;
 	return (stat (filename, &buffer) == 0);
 }
 
-void make_target_fits_filename(converter_params_t *arg, char *raw_filename, char *out_filename, char *postfix)
+void make_target_fits_filename(converter_params_t *arg, file_metadata_t *meta, char *raw_filename, char *out_filename, char *postfix)
 {
 	int iter = 0;
 	char *out_file_name_base = NULL, *obj, *datetime, *filter;
@@ -141,8 +131,8 @@ void make_target_fits_filename(converter_params_t *arg, char *raw_filename, char
 			break;
 
 		case RAW_DATETIME:
-			if (strlen(arg->meta.date) > 0) {
-				datetime = arg->meta.date;
+			if (strlen(meta->date) > 0) {
+				datetime = meta->date;
 			} else {
 				datetime = "NO_DATE";
 			}
@@ -159,14 +149,14 @@ void make_target_fits_filename(converter_params_t *arg, char *raw_filename, char
 			break;
 
 		case OBJECT_DATETIME:
-			if (strlen(arg->meta.object) > 0) {
-				obj = arg->meta.object;
+			if (strlen(meta->object) > 0) {
+				obj = meta->object;
 			} else {
 				obj = base_raw_filename;
 			}
 
-			if (strlen(arg->meta.date) > 0) {
-				datetime = arg->meta.date;
+			if (strlen(meta->date) > 0) {
+				datetime = meta->date;
 			} else {
 				datetime = "NO_DATE";
 			}
@@ -184,20 +174,20 @@ void make_target_fits_filename(converter_params_t *arg, char *raw_filename, char
 			break;
 
 		case OBJECT_FILTER_DATETIME:
-			if (strlen(arg->meta.object) > 0) {
-				obj = arg->meta.object;
+			if (strlen(meta->object) > 0) {
+				obj = meta->object;
 			} else {
 				obj = base_raw_filename;
 			}
 
-			if (strlen(arg->meta.filter) > 0) {
-				filter = arg->meta.filter;
+			if (strlen(meta->filter) > 0) {
+				filter = meta->filter;
 			} else {
 				filter = "NO_FILTER";
 			}
 
-			if (strlen(arg->meta.date) > 0) {
-				datetime = arg->meta.date;
+			if (strlen(meta->date) > 0) {
+				datetime = meta->date;
 			} else {
 				datetime = "NO_DATE";
 			}
@@ -0,0 +1,420 @@
+/* 
+   fits_writer.c
+    - native FITS writer for the simple image HDUs, the output is the same as cfitsio makes
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
+#include <sys/uio.h>
+#include <fitsio.h>
+#include "fits_writer.h"
+
+#define FITS_VALUE_SIZE 71
+
+static const char FITS_ZERO_BLOCK[FITS_BLOCK_SIZE];
+
+/* 
+   Cards are formatted the same way as cfitsio does it:
+   values end in column 30, strings are at least 8 chars long, comment goes after " / "
+ */
+static void make_card(const char *keyname, const char *value, const char *comment, char *card)
+{
+	size_t len = strlen(value);
+
+	snprintf(card, FITS_CARD_SIZE + 1, "%-8.8s= ", keyname);
+
+	if (value[0] == '\'') {
+		strncat(card, value, FITS_CARD_SIZE - 10);
+		len = len + 10 < FITS_CARD_SIZE ? len + 10 : FITS_CARD_SIZE;
+
+		/* restore the closing quote if it got truncated */
+		if (len == FITS_CARD_SIZE) {
+			card[FITS_CARD_SIZE - 1] = '\'';
+		}
+
+		if (comment[0] && len < 30) {
+			memset(card + len, ' ', 30 - len);
+			card[30] = '\0';
+			len = 30;
+		}
+	} else {
+		/* right justified value, card is "KEYNAME = " so far */
+		if (len + 10 < 30) {
+			memset(card + 10, ' ', 20 - len);
+			card[30 - len] = '\0';
+		}
+
+		strncat(card, value, FITS_CARD_SIZE - 10);
+		len = len + 10 < FITS_CARD_SIZE ? len + 10 : FITS_CARD_SIZE;
+		len = len > 30 ? len : 30;
+	}
+
+	if (comment[0] && len < FITS_CARD_SIZE - 3) {
+		strcat(card, " / ");
+		strncat(card, comment, FITS_CARD_SIZE - 3 - len);
+	}
+}
+
+/* quotes are doubled, string is limited by 68 chars and padded to 8 */
+static void make_string_value(const char *str, char *value)
+{
+	size_t len = strlen(str);
+	size_t i, j;
+
+	if (len > 68) {
+		len = 68;
+	}
+
+	value[0] = '\'';
+
+	for (i = 0, j = 1; i < len && j < 69; i++, j++) {
+		value[j] = str[i];
+
+		if (str[i] == '\'') {
+			value[++j] = '\'';
+		}
+	}
+
+	for (; j < 9; j++) {
+		value[j] = ' ';
+	}
+
+	if (j == 70) {
+		value[69] = '\0';
+	} else {
+		value[j] = '\'';
+		value[j + 1] = '\0';
+	}
+}
+
+/* 7 significant digits, there is always a decimal point or an exponent */
+static int make_float_value(float fval, char *value)
+{
+	snprintf(value, FITS_VALUE_SIZE, "%.7G", fval);
+
+	if (!strchr(value, '.') && strchr(value, 'E')) {
+		snprintf(value, FITS_VALUE_SIZE, "%.1E", fval);
+	}
+
+	/* NaN and infinity */
+	if (strchr(value, 'N')) {
+		return BAD_F2C;
+	}
+
+	if (!strchr(value, '.') && !strchr(value, 'E')) {
+		strcat(value, ".");
+	}
+
+	return 0;
+}
+
+/* header buffer grows by blocks, the tail is kept filled with spaces */
+static int add_card(fits_writer_t *fw, const char *card, int *status)
+{
+	char *header, *dst;
+	size_t i;
+
+	if (*status > 0) {
+		return *status;
+	}
+
+	if (fw->header_len + FITS_CARD_SIZE > fw->header_size) {
+		header = realloc(fw->header, fw->header_size + FITS_BLOCK_SIZE);
+
+		if (!header) {
+			return *status = MEMORY_ALLOCATION;
+		}
+
+		memset(header + fw->header_size, ' ', FITS_BLOCK_SIZE);
+
+		fw->header = header;
+		fw->header_size += FITS_BLOCK_SIZE;
+	}
+
+	dst = fw->header + fw->header_len;
+
+	/* non-printable chars are replaced by spaces, keyword is in upper case */
+	for (i = 0; i < FITS_CARD_SIZE && card[i]; i++) {
+		dst[i] = (card[i] < ' ' || card[i] > 126) ? ' ' : card[i];
+
+		if (i < 8 && dst[i] >= 'a' && dst[i] <= 'z') {
+			dst[i] -= 'a' - 'A';
+		}
+	}
+
+	fw->header_len += FITS_CARD_SIZE;
+
+	return *status;
+}
+
+static void reset_header(fits_writer_t *fw)
+{
+	if (fw->header_len) {
+		memset(fw->header, ' ', fw->header_len);
+		fw->header_len = 0;
+	}
+}
+
+static int add_value_card(fits_writer_t *fw, const char *keyname, const char *value, const char *comment, int *status)
+{
+	char card[FITS_CARD_SIZE + 1];
+
+	make_card(keyname, value, comment ? comment : "", card);
+
+	return add_card(fw, card, status);
+}
+
+static int add_int_card(fits_writer_t *fw, const char *keyname, long long val, const char *comment, int *status)
+{
+	char value[FITS_VALUE_SIZE];
+
+	snprintf(value, FITS_VALUE_SIZE, "%lld", val);
+
+	return add_value_card(fw, keyname, value, comment, status);
+}
+
+static int write_blocks(int fd, struct iovec *iov, int iovcnt)
+{
+	ssize_t done;
+
+	while (iovcnt > 0) {
+		done = writev(fd, iov, iovcnt);
+
+		if (done < 0) {
+			if (errno == EINTR) {
+				continue;
+			}
+
+			return -1;
+		}
+
+		while (iovcnt > 0 && (size_t) done >= iov->iov_len) {
+			done -= iov->iov_len;
+			iov++;
+			iovcnt--;
+		}
+
+		if (iovcnt > 0) {
+			iov->iov_base = (char *) iov->iov_base + done;
+			iov->iov_len -= done;
+		}
+	}
+
+	return 0;
+}
+
+int fits_writer_create(fits_writer_t *fw, const char *filename, int *status)
+{
+	memset(fw, 0, sizeof(fits_writer_t));
+
+	if (*status > 0) {
+		fw->fd = -1;
+		return *status;
+	}
+
+	/* same as cfitsio, existing file is not overwritten */
+	fw->fd = open(filename, O_WRONLY | O_CREAT | O_EXCL, 0666);
+
+	if (fw->fd < 0) {
+		*status = FILE_NOT_CREATED;
+	}
+
+	return *status;
+}
+
+int fits_writer_create_img(fits_writer_t *fw, int bitpix, int width, int height, int *status)
+{
+	char value[FITS_VALUE_SIZE];
+
+	if (*status > 0) {
+		return *status;
+	}
+
+	reset_header(fw);
+
+	if (fw->hdus == 0) {
+		add_value_card(fw, "SIMPLE", "T", "file does conform to FITS standard", status);
+	} else {
+		make_string_value("IMAGE", value);
+		add_value_card(fw, "XTENSION", value, "IMAGE extension", status);
+	}
+
+	add_int_card(fw, "BITPIX", bitpix == USHORT_IMG ? SHORT_IMG : bitpix, "number of bits per data pixel", status);
+	add_int_card(fw, "NAXIS", 2, "number of data axes", status);
+	add_int_card(fw, "NAXIS1", width, "length of data axis 1", status);
+	add_int_card(fw, "NAXIS2", height, "length of data axis 2", status);
+
+	if (fw->hdus == 0) {
+		add_value_card(fw, "EXTEND", "T", "FITS dataset may contain extensions", status);
+		fits_writer_write_comment(fw, "  FITS (Flexible Image Transport System) format is"
+										" defined in 'Astronomy", status);
+		fits_writer_write_comment(fw, "  and Astrophysics', volume 376, page 359;"
+										" bibcode: 2001A&A...376..359H", status);
+	} else {
+		add_int_card(fw, "PCOUNT", 0, "required keyword; must = 0", status);
+		add_int_card(fw, "GCOUNT", 1, "required keyword; must = 1", status);
+	}
+
+	if (bitpix == USHORT_IMG) {
+		add_value_card(fw, "BZERO", "32768", "offset data range to that of unsigned short", status);
+		add_value_card(fw, "BSCALE", "1", "default scaling factor", status);
+	}
+
+	fw->hdus++;
+
+	return *status;
+}
+
+int fits_writer_make_key(int datatype, const char *keyname, void *value, const char *comment,
+										char *card, int *status)
+{
+	char str[FITS_VALUE_SIZE];
+
+	if (*status > 0) {
+		return *status;
+	}
+
+	switch (datatype) {
+		case TSTRING:
+			make_string_value((const char *) value, str);
+			break;
+
+		case TLOGICAL:
+			strcpy(str, *(int *) value ? "T" : "F");
+			break;
+
+		case TINT:
+			snprintf(str, FITS_VALUE_SIZE, "%i", *(int *) value);
+			break;
+
+		case TFLOAT:
+			if (make_float_value(*(float *) value, str) != 0) {
+				return *status = BAD_F2C;
+			}
+
+			break;
+
+		default:
+			return *status = BAD_DATATYPE;
+	}
+
+	make_card(keyname, str, comment ? comment : "", card);
+
+	return *status;
+}
+
+int fits_writer_write_key(fits_writer_t *fw, int datatype, const char *keyname, void *value,
+										const char *comment, int *status)
+{
+	char card[FITS_CARD_SIZE + 1];
+
+	if (fits_writer_make_key(datatype, keyname, value, comment, card, status) > 0) {
+		return *status;
+	}
+
+	return add_card(fw, card, status);
+}
+
+int fits_writer_write_record(fits_writer_t *fw, const char *card, int *status)
+{
+	return add_card(fw, card, status);
+}
+
+/* long comment takes several cards, 72 chars each */
+int fits_writer_write_comment(fits_writer_t *fw, const char *comment, int *status)
+{
+	char card[FITS_CARD_SIZE + 1];
+	size_t len = strlen(comment);
+	size_t part;
+
+	while (len > 0 && *status <= 0) {
+		part = len > 72 ? 72 : len;
+
+		snprintf(card, FITS_CARD_SIZE + 1, "COMMENT %.72s", comment);
+		add_card(fw, card, status);
+
+		comment += part;
+		len -= part;
+	}
+
+	return *status;
+}
+
+/* 
+   Header, END card, data and the padding go to the file with one writev(),
+   header block is already padded with spaces and the data padding is a zero block.
+ */
+int fits_writer_write_image(fits_writer_t *fw, void *frame, int width, int height, int bitpix, int *status)
+{
+	struct iovec iov[3];
+	size_t data_len, pixels = (size_t) width * height;
+	uint32_t *words;
+	size_t i;
+
+	if (add_card(fw, "END", status) > 0) {
+		return *status;
+	}
+
+	data_len = pixels * (bitpix == FLOAT_IMG ? sizeof(float) : sizeof(uint16_t));
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	if (bitpix == FLOAT_IMG) {
+		words = (uint32_t *) frame;
+
+		for (i = 0; i < pixels; i++) {
+			words[i] = __builtin_bswap32(words[i]);
+		}
+	}
+#endif
+
+	iov[0].iov_base = fw->header;
+	iov[0].iov_len = (fw->header_len + FITS_BLOCK_SIZE - 1) / FITS_BLOCK_SIZE * FITS_BLOCK_SIZE;
+	iov[1].iov_base = frame;
+	iov[1].iov_len = data_len;
+	iov[2].iov_base = (void *) FITS_ZERO_BLOCK;
+	iov[2].iov_len = (FITS_BLOCK_SIZE - data_len % FITS_BLOCK_SIZE) % FITS_BLOCK_SIZE;
+
+	if (write_blocks(fw->fd, iov, 3) < 0) {
+		*status = WRITE_ERROR;
+	}
+
+	reset_header(fw);
+
+	return *status;
+}
+
+/* header without the data is dropped, nothing is buffered besides it */
+int fits_writer_close(fits_writer_t *fw, int *status)
+{
+	if (fw->fd >= 0 && close(fw->fd) != 0 && *status <= 0) {
+		*status = FILE_NOT_CLOSED;
+	}
+
+	free(fw->header);
+
+	fw->fd = -1;
+	fw->header = NULL;
+	fw->header_len = fw->header_size = 0;
+
+	return *status;
+}
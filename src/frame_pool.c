@@ -0,0 +1,151 @@
+/* 
+   frame_pool.c
+    - reusable frame buffers, decoded planes don't go through malloc/free for every file
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdlib.h>
+#include <pthread.h>
+#include <sys/mman.h>
+#include "frame_pool.h"
+
+#define FRAME_POOL_PAGE_ALIGN (2UL * 1024 * 1024)
+
+static pthread_mutex_t pool_lock = PTHREAD_MUTEX_INITIALIZER;
+static frame_buf_t *free_frames = NULL;
+static size_t largest_frame = 0;
+
+/* 
+   Frames are mapped directly, big buffers are aligned to the huge page size
+   and marked for transparent huge pages, so the page faults are paid only once.
+ */
+static int frame_buf_map(frame_buf_t *buf, size_t size)
+{
+	size = (size + FRAME_POOL_PAGE_ALIGN - 1) & ~(FRAME_POOL_PAGE_ALIGN - 1);
+
+	buf->data = mmap(NULL, size, PROT_READ | PROT_WRITE, MAP_PRIVATE | MAP_ANONYMOUS, -1, 0);
+
+	if (buf->data == MAP_FAILED) {
+		buf->data = NULL;
+		buf->capacity = 0;
+		return -1;
+	}
+
+#ifdef MADV_HUGEPAGE
+	madvise(buf->data, size, MADV_HUGEPAGE);
+#endif
+
+	buf->capacity = size;
+
+	return 0;
+}
+
+static void frame_buf_unmap(frame_buf_t *buf)
+{
+	if (buf->data) {
+		munmap(buf->data, buf->capacity);
+		buf->data = NULL;
+		buf->capacity = 0;
+	}
+}
+
+/* returns buffer of at least size bytes, free buffers are reused and grown to the largest frame */
+frame_buf_t *frame_pool_get(size_t size)
+{
+	frame_buf_t *buf, **prev;
+
+	pthread_mutex_lock(&pool_lock);
+
+	if (size > largest_frame) {
+		largest_frame = size;
+	}
+
+	size = largest_frame;
+
+	for (prev = &free_frames; *prev; prev = &(*prev)->next) {
+		if ((*prev)->capacity >= size) {
+			break;
+		}
+	}
+
+	if (!*prev) {
+		prev = &free_frames;
+	}
+
+	buf = *prev;
+
+	if (buf) {
+		*prev = buf->next;
+	}
+
+	pthread_mutex_unlock(&pool_lock);
+
+	if (!buf) {
+		buf = (frame_buf_t *) calloc(1, sizeof(frame_buf_t));
+
+		if (!buf) {
+			return NULL;
+		}
+	}
+
+	buf->next = NULL;
+
+	if (buf->capacity < size) {
+		frame_buf_unmap(buf);
+
+		if (frame_buf_map(buf, size) < 0) {
+			free(buf);
+			return NULL;
+		}
+	}
+
+	return buf;
+}
+
+void frame_pool_put(frame_buf_t *buf)
+{
+	if (!buf) {
+		return;
+	}
+
+	pthread_mutex_lock(&pool_lock);
+
+	buf->next = free_frames;
+	free_frames = buf;
+
+	pthread_mutex_unlock(&pool_lock);
+}
+
+/* unmaps all free buffers, called between the batches */
+void frame_pool_cleanup()
+{
+	frame_buf_t *buf;
+
+	pthread_mutex_lock(&pool_lock);
+
+	while (free_frames) {
+		buf = free_frames;
+		free_frames = buf->next;
+
+		frame_buf_unmap(buf);
+		free(buf);
+	}
+
+	largest_frame = 0;
+
+	pthread_mutex_unlock(&pool_lock);
+}
@@ -1,6 +1,6 @@
 /* 
    list.c
-    - simple list implementation with some specifics for raw2fits
+    - array-backed files list with the strings arena, specific for raw2fits
 
    Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
 
@@ -22,59 +22,146 @@
 #include <string.h>
 #include "list.h"
 
-list_node_t *add_object_to_list(list_node_t *list, char *object)
+file_list_t *file_list_create()
 {
-	list_node_t *new_item = (list_node_t *) malloc(sizeof(list_node_t));
+	return (file_list_t *) calloc(1, sizeof(file_list_t));
+}
+
+/* all paths are packed into the big blocks, one allocation per many files */
+static char *file_list_store_string(file_list_t *list, const char *str)
+{
+	size_t len = strlen(str) + 1;
+	size_t block_size = FILE_LIST_ARENA_BLOCK;
+	string_block_t *block = list->strings;
+	char *dst;
+
+	if (!block || block->size - block->used < len) {
+		if (len > block_size) {
+			block_size = len;
+		}
 
-	new_item->object = (char *) malloc(strlen(object) + 1);
+		block = (string_block_t *) malloc(sizeof(string_block_t) + block_size);
 
-	strcpy(new_item->object, object);
-	new_item->next = list;
+		if (!block) {
+			return NULL;
+		}
 
-	list = new_item;
+		block->size = block_size;
+		block->used = 0;
+		block->next = list->strings;
+		list->strings = block;
+	}
 
-	return list;
+	dst = block->data + block->used;
+	memcpy(dst, str, len);
+	block->used += len;
+
+	return dst;
 }
 
-void free_list(list_node_t *list)
+/* returns index of the new entry, or -1 */
+int file_list_add(file_list_t *list, const char *path, long size, long weight, int tag)
 {
-	if (list == NULL) {
-		return;
-	}
+	int chunk = list->count >> FILE_LIST_CHUNK_SHIFT;
+	file_entry_t *entry;
 
-	list_node_t *head = list;
-	list_node_t *prev = NULL;
+	if (chunk >= FILE_LIST_MAX_CHUNKS) {
+		return -1;
+	}
 
-	while (head != NULL) {
-		prev = head;
-		head = head->next;
+	if (!list->chunks[chunk]) {
+		list->chunks[chunk] = (file_entry_t *) malloc(sizeof(file_entry_t) * FILE_LIST_CHUNK_SIZE);
 
-		if (prev->object) {
-			free(prev->object);
-			prev->object = NULL;
+		if (!list->chunks[chunk]) {
+			return -1;
 		}
+	}
 
-		free(prev);
-		prev = NULL;
+	entry = &list->chunks[chunk][list->count & (FILE_LIST_CHUNK_SIZE - 1)];
+
+	entry->path = file_list_store_string(list, path);
+
+	if (!entry->path) {
+		return -1;
 	}
+
+	entry->size = size;
+	entry->weight = weight;
+	entry->tag = tag;
+	entry->state = FILE_FOUND;
+
+	return list->count++;
 }
 
-void iterate_list_cb(list_node_t *list, iterate_cb cb, void* arg, int offset, int count, char *sflag)
+file_entry_t *file_list_get(file_list_t *list, int index)
 {
-	int curr_offset = 0;
-	list_node_t *tmp;
+	return &list->chunks[index >> FILE_LIST_CHUNK_SHIFT][index & (FILE_LIST_CHUNK_SIZE - 1)];
+}
 
-	for (tmp = list; tmp; tmp = tmp->next) {
-		if (!*sflag) {
-			break;
-		}
+/* next unclaimed entry in the list order, safe to call from many threads when list is not growing */
+int file_list_claim(file_list_t *list)
+{
+	int index = __atomic_fetch_add(&list->next_claim, 1, __ATOMIC_RELAXED);
 
-		if (curr_offset >= offset) {
-			if (curr_offset == count) {
-				break;
-			}
+	return index < list->count ? index : -1;
+}
 
-			(*cb) (tmp->object, arg);
-		}
+static file_list_t *sort_list;
+
+/* the heaviest objects go first, equal ones keep the list order */
+static int compare_by_weight(const void *a, const void *b)
+{
+	int ia = *(const int *) a;
+	int ib = *(const int *) b;
+	long wa = file_list_get(sort_list, ia)->weight;
+	long wb = file_list_get(sort_list, ib)->weight;
+
+	if (wa != wb) {
+		return wa > wb ? -1 : 1;
+	}
+
+	return ia - ib;
+}
+
+/* returns array of the entries indexes, caller frees it */
+int *file_list_sort_by_weight(file_list_t *list)
+{
+	int i;
+	int *order = (int *) malloc(sizeof(int) * (list->count ? list->count : 1));
+
+	if (!order) {
+		return NULL;
+	}
+
+	for (i = 0; i < list->count; i++) {
+		order[i] = i;
+	}
+
+	sort_list = list;
+	qsort(order, list->count, sizeof(int), compare_by_weight);
+	sort_list = NULL;
+
+	return order;
+}
+
+void file_list_free(file_list_t *list)
+{
+	int i;
+	string_block_t *block;
+
+	if (!list) {
+		return;
 	}
+
+	for (i = 0; i < FILE_LIST_MAX_CHUNKS && list->chunks[i]; i++) {
+		free(list->chunks[i]);
+	}
+
+	while (list->strings) {
+		block = list->strings;
+		list->strings = block->next;
+		free(block);
+	}
+
+	free(list);
 }
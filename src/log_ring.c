@@ -0,0 +1,190 @@
+/* 
+   log_ring.c
+    - asynchronous logger, lock-free ring buffer drained by the one consumer thread
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <errno.h>
+#include "log_ring.h"
+
+/* takes one published message, returns 0 when the ring is empty */
+static int log_ring_pop(log_ring_t *ring, char *dst)
+{
+	log_ring_slot_t *slot = &ring->slots[ring->head & ring->mask];
+
+	if (__atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE) != ring->head + 1) {
+		return 0;
+	}
+
+	strcpy(dst, slot->msg);
+
+	/* slot is free for the producer of the next lap */
+	__atomic_store_n(&slot->seq, ring->head + ring->mask + 1, __ATOMIC_RELEASE);
+
+	ring->head++;
+
+	return 1;
+}
+
+/* consumer collects all ready messages into one batch, sink is called once per batch */
+static void *log_ring_consumer(void *arg)
+{
+	log_ring_t *ring = (log_ring_t *) arg;
+	char batch[LOG_RING_BATCH_SIZE];
+	unsigned long dropped;
+	size_t len;
+	int popped;
+
+	while (1) {
+		while (sem_wait(&ring->ready) < 0 && errno == EINTR) {
+			continue;
+		}
+
+		len = 0;
+		popped = 0;
+
+		while (len + LOG_RING_MSG_SIZE <= LOG_RING_BATCH_SIZE && log_ring_pop(ring, batch + len)) {
+			len += strlen(batch + len);
+			popped++;
+		}
+
+		dropped = __atomic_exchange_n(&ring->dropped, 0, __ATOMIC_RELAXED);
+
+		if (dropped && len + LOG_RING_MSG_SIZE <= LOG_RING_BATCH_SIZE) {
+			len += snprintf(batch + len, LOG_RING_MSG_SIZE, "Logger is overloaded, %lu messages dropped\n", dropped);
+		} else if (dropped) {
+			__atomic_add_fetch(&ring->dropped, dropped, __ATOMIC_RELAXED);
+		}
+
+		if (len > 0) {
+			ring->sink(ring->sink_arg, batch);
+
+			/* batch was full, there are messages left without own wakeup */
+			if (len + LOG_RING_MSG_SIZE > LOG_RING_BATCH_SIZE) {
+				sem_post(&ring->ready);
+				continue;
+			}
+
+			/* 
+			   Dropped message posts nothing, so the batch with only the drop notice
+			   may come from the stop wakeup and must not wait for another one.
+			 */
+			if (popped > 0) {
+				continue;
+			}
+		}
+
+		if (__atomic_load_n(&ring->stop, __ATOMIC_ACQUIRE)) {
+			break;
+		}
+	}
+
+	return NULL;
+}
+
+/* capacity is rounded up to the power of two */
+log_ring_t *log_ring_create(int capacity, log_ring_sink sink, void *sink_arg)
+{
+	unsigned long i, size = 1;
+	log_ring_t *ring = (log_ring_t *) calloc(1, sizeof(log_ring_t));
+
+	if (!ring) {
+		return NULL;
+	}
+
+	while (size < capacity) {
+		size <<= 1;
+	}
+
+	ring->slots = (log_ring_slot_t *) malloc(sizeof(log_ring_slot_t) * size);
+
+	if (!ring->slots) {
+		free(ring);
+		return NULL;
+	}
+
+	for (i = 0; i < size; i++) {
+		ring->slots[i].seq = i;
+	}
+
+	ring->mask = size - 1;
+	ring->sink = sink;
+	ring->sink_arg = sink_arg;
+
+	sem_init(&ring->ready, 0, 0);
+
+	pthread_create(&ring->consumer, NULL, log_ring_consumer, ring);
+
+	return ring;
+}
+
+/* 
+   Never blocks: producer formats the message right in the reserved slot,
+   when the consumer is behind and the ring is full, message is dropped and counted.
+ */
+int log_ring_vprintf(log_ring_t *ring, const char *fmt, va_list args)
+{
+	log_ring_slot_t *slot;
+	unsigned long pos, seq;
+
+	pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+
+	while (1) {
+		slot = &ring->slots[pos & ring->mask];
+		seq = __atomic_load_n(&slot->seq, __ATOMIC_ACQUIRE);
+
+		if (seq == pos) {
+			if (__atomic_compare_exchange_n(&ring->tail, &pos, pos + 1, 1, __ATOMIC_RELAXED, __ATOMIC_RELAXED)) {
+				break;
+			}
+		} else if ((long) (seq - pos) < 0) {
+			__atomic_add_fetch(&ring->dropped, 1, __ATOMIC_RELAXED);
+			return -1;
+		} else {
+			pos = __atomic_load_n(&ring->tail, __ATOMIC_RELAXED);
+		}
+	}
+
+	vsnprintf(slot->msg, LOG_RING_MSG_SIZE, fmt, args);
+
+	__atomic_store_n(&slot->seq, pos + 1, __ATOMIC_RELEASE);
+
+	sem_post(&ring->ready);
+
+	return 0;
+}
+
+/* all messages pushed before the call are delivered to the sink */
+void log_ring_free(log_ring_t *ring)
+{
+	if (!ring) {
+		return;
+	}
+
+	__atomic_store_n(&ring->stop, 1, __ATOMIC_RELEASE);
+	sem_post(&ring->ready);
+
+	pthread_join(ring->consumer, NULL);
+
+	sem_destroy(&ring->ready);
+
+	free(ring->slots);
+	free(ring);
+}
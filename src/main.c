@@ -25,14 +25,17 @@
 #include <stdarg.h>
 #include "converter.h"
 #include "coords_calc.h"
+#include "log_ring.h"
 #include "version.h"
 
+#define LOG_RING_CAPACITY 1024
+
 static char *RAW_PATH = NULL;
 static char *OUT_PATH = NULL;
 
 static GMainContext *main_context;
 static GMutex progress_bar_mutex;
-static GMutex logger_mutex;
+static log_ring_t *log_ring = NULL;
 
 typedef struct dialog_argument {
 	GtkWindow *main_window;
@@ -47,7 +50,7 @@ typedef struct about_dialog_argument {
 
 typedef struct log_msg_threaded {
 	void *arg;
-	char buf[256];
+	char *buf;
 } log_msg_threaded_t;
 
 typedef struct done_cb_argument {
@@ -154,28 +157,34 @@ void progress_setup(void *arg, int max_val)
 
 	gtk_progress_bar_set_fraction(pbar, 0.0);
 
-	progr->fraction = 1.0 / max_val;
+	progr->fraction = 0.0;
 }
 
 static gboolean update_progress_bar(gpointer arg)
 {
 	progress_params_t *progr = (progress_params_t*) arg;
 	GtkProgressBar *pbar = GTK_PROGRESS_BAR(progr->progr_arg);
+	gdouble fraction;
 
-	gdouble fraction = gtk_progress_bar_get_fraction(pbar);
-	fraction += progr->fraction;
+	g_mutex_lock(&progress_bar_mutex);
+	fraction = progr->fraction;
+	g_mutex_unlock(&progress_bar_mutex);
 
 	gtk_progress_bar_set_fraction(pbar, fraction);
 
 	return G_SOURCE_REMOVE;
 }
 
-void progress_update(void *arg)
+void progress_update(void *arg, progress_stats_t *stats)
 {
+	progress_params_t *progr = (progress_params_t*) arg;
 	GSource *source;
 
 	g_mutex_lock(&progress_bar_mutex);
 
+	/* UI shows the latest state only, converter limits the updates rate */
+	progr->fraction = (float) stats->files_done / stats->files_total;
+
 	source = g_idle_source_new();
 
 	g_source_set_callback(source, update_progress_bar, arg, NULL);
@@ -199,18 +208,20 @@ static gboolean update_textarea(gpointer user_data)
 
 	gtk_text_view_scroll_to_mark(GTK_TEXT_VIEW(log_arg->arg), gtk_text_buffer_get_insert(buffer), 0.0, FALSE, 0.5, 0.5);
 
+	g_free(log_arg->buf);
 	free(user_data);
 
 	return G_SOURCE_REMOVE;
 }
 
-void logger_msg_preformat(void *arg, char *str)
+/* called by the logger thread with a batch of messages */
+void logger_msg_preformat(void *arg, const char *str)
 {
 	log_msg_threaded_t *log_arg = (log_msg_threaded_t *) malloc(sizeof(log_msg_threaded_t));
 	GSource *source;
 
 	log_arg->arg = arg;
-	strcpy(log_arg->buf, str);
+	log_arg->buf = g_strdup(str);
 
 	source = g_idle_source_new();
 
@@ -221,21 +232,12 @@ void logger_msg_preformat(void *arg, char *str)
 
 void logger_msg(void *arg, char *fmt, ...)
 {
-	g_mutex_lock(&logger_mutex);
-
-	char buf[256];
-
 	va_list args;
 
 	va_start(args, fmt);
-	vsnprintf(buf, 256, fmt, args);
-	buf[255] = '\0';
+	log_ring_vprintf(log_ring, fmt, args);
 
 	va_end(args);
-
-	logger_msg_preformat(arg, buf);
-
-	g_mutex_unlock(&logger_mutex);
 }
 
 static gboolean converting_done_update_ui(gpointer user_data)
@@ -311,9 +313,19 @@ void button_convert_clicked_cb(GtkButton *button, conv_start_argument_t *arg)
 	conv_params->fsetup.naming = gtk_combo_box_get_active(arg->combobox_filenaming);
 
 	conv_params->fsetup.overwrite = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(arg->overwrite_file));
+	conv_params->fsetup.recursive = 0;
 	conv_params->imsetup.apply_auto_bright = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(arg->autobright));
 	conv_params->imsetup.apply_interpolation = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(arg->interpolation));
 	conv_params->imsetup.apply_autoscale = gtk_toggle_button_get_active(GTK_TOGGLE_BUTTON(arg->autoscale));
+	conv_params->imsetup.binning = 1;
+	conv_params->imsetup.binning_sum = 0;
+	conv_params->imsetup.cfa_channels = CFA_CHANNELS_DEBAYER;
+	conv_params->imsetup.bitpix = 16;
+	conv_params->imsetup.normalize = NORMALIZE_NONE;
+
+	conv_params->schedule = SCHEDULE_LARGEST_FIRST;
+	conv_params->fits_backend = FITS_BACKEND_CFITSIO;
+	conv_params->kernel[0] = '\0';
 
 	memset(conv_params->inpath, 0, sizeof(conv_params->inpath));
 	strncpy(conv_params->inpath, RAW_PATH, strlen(RAW_PATH));
@@ -325,6 +337,7 @@ void button_convert_clicked_cb(GtkButton *button, conv_start_argument_t *arg)
 	conv_params->progress.progr_setup = &progress_setup;
 	conv_params->progress.progr_update = &progress_update;
 
+	conv_params->log_level = LOG_LEVEL_DEBUG;
 	conv_params->logger_arg = (void *) arg->textview;
 	conv_params->logger_msg = &logger_msg;
 
@@ -584,16 +597,19 @@ int main(int argc, char *argv[])
 	g_object_unref(builder);
 
 	g_mutex_init(&progress_bar_mutex);
-	g_mutex_init(&logger_mutex);
 
 	main_context = g_main_context_default();
 
+	log_ring = log_ring_create(LOG_RING_CAPACITY, &logger_msg_preformat, conv_arg.textview);
+
 	gtk_widget_show(window);                
 	gtk_main();
 
 	converter_stop(conv_stop_arg.conv_params);
 
-	g_mutex_clear(&logger_mutex);
+	log_ring_free(log_ring);
+	log_ring = NULL;
+
 	g_mutex_clear(&progress_bar_mutex);
 
 	return 0;
@@ -28,23 +28,31 @@
 #include "config_loader.h"
 #include "converter.h"
 #include "file_utils.h"
+#include "log_ring.h"
+#include "pixel_kernels.h"
 #include "version.h"
 
+#define LOG_RING_CAPACITY 1024
+
 static int QUIET_FLAG = 0;
+static int VERBOSE_LEVEL = LOG_LEVEL_INFO;
 static volatile int RUN_FLAG = 0;
 
-static int QUITE_COUNTER_ANI = 0;
-static int QUITE_MAX_COUNTER_ANI = 0;
+#define PROGRESS_BAR_WIDTH 50
 
 static char *PROGRESS_ANI_CHARS = NULL;
 
+static log_ring_t *LOG_RING = NULL;
+
 static struct option cmd_long_options[] =
 {
 	{"quiet", no_argument, 0, 'q'},
+	{"verbose", no_argument, 0, 'v'},
 	{"help",   no_argument, 0, 'h'},
 	{"input",   required_argument, 0, 'i'},
 	{"output",  required_argument, 0, 'o'},
 	{"config",  required_argument, 0, 'c'},
+	{"kernel",  required_argument, 0, 'k'},
 	{0, 0, 0, 0}
 };
 
@@ -56,51 +64,52 @@ void show_help()
 
 	printf("\t-h, --help\t\tShow this help and exit\n");
 	printf("\t-q, --quiet\t\tReduce ouptut messages\n");
+	printf("\t-v, --verbose\t\tMore converter messages, repeat for decoder steps\n");
 	printf("\t-i, --input\t\tSet directory with RAW files\n");
 	printf("\t-o, --output\t\tSet directory for output FITS files\n");
 	printf("\t-c, --config <file>\tConfiguration file for converter\n");
+	printf("\t-k, --kernel <name>\tPixel kernels: auto (default), scalar, sse2, ssse3, avx2, avx512 or neon\n");
 }
 
+/* number of files grows while the directory is scanned, so bar has the fixed width */
 void progress_setup(void *arg, int max_val)
 {
-	QUITE_MAX_COUNTER_ANI = max_val;
-
-	PROGRESS_ANI_CHARS = (char *) calloc(1, QUITE_MAX_COUNTER_ANI + 1);
-	PROGRESS_ANI_CHARS[0] = '[';
+	if (!PROGRESS_ANI_CHARS) {
+		PROGRESS_ANI_CHARS = (char *) calloc(1, PROGRESS_BAR_WIDTH + 3);
+	}
 }
 
-void progress_update(void *arg)
+void progress_update(void *arg, progress_stats_t *stats)
 {
-	int i;
-	int pval = ((float)QUITE_COUNTER_ANI / (float)QUITE_MAX_COUNTER_ANI) * 100;
-
-	for (i = 1; i < QUITE_MAX_COUNTER_ANI; i++) {
-		if (i <= QUITE_COUNTER_ANI) {
-			PROGRESS_ANI_CHARS[i] = '=';
-		} else {
-			PROGRESS_ANI_CHARS[i] = ' ';
-		}
+	int i, filled;
+	int pval = stats->files_total > 0 ? ((float)stats->files_done / (float)stats->files_total) * 100 : 0;
 
-		if (i == QUITE_MAX_COUNTER_ANI -1) {
-			PROGRESS_ANI_CHARS[i] = ']';
-		}
-	}
+	filled = pval * PROGRESS_BAR_WIDTH / 100;
+
+	PROGRESS_ANI_CHARS[0] = '[';
 
-	if (QUITE_COUNTER_ANI == QUITE_MAX_COUNTER_ANI - 1) {
-		pval = 100;
+	for (i = 0; i < PROGRESS_BAR_WIDTH; i++) {
+		PROGRESS_ANI_CHARS[i + 1] = i < filled ? '=' : ' ';
 	}
 
-	printf("\rOverall progress: %s - %i %%", PROGRESS_ANI_CHARS, pval);
+	PROGRESS_ANI_CHARS[PROGRESS_BAR_WIDTH + 1] = ']';
+
+	printf("\rOverall progress: %s - %i %% (%i/%i, %.1f files/s)", PROGRESS_ANI_CHARS, pval,
+							stats->files_done, stats->files_total, stats->rate);
 
 	if (QUIET_FLAG) {
 		fflush(stdout);
 	} else {
 		printf("\n");
 	}
+}
 
-	QUITE_COUNTER_ANI++;
+void logger_print(void *arg, const char *text)
+{
+	fputs(text, stdout);
 }
 
+/* converter threads don't wait for the terminal, messages are printed by the logger thread */
 void logger_msg(void *arg, char *fmt, ...)
 {
 	if (QUIET_FLAG) {
@@ -110,7 +119,7 @@ void logger_msg(void *arg, char *fmt, ...)
 	va_list args;
 
 	va_start(args, fmt);
-	vprintf(fmt, args);
+	log_ring_vprintf(LOG_RING, fmt, args);
 
 	va_end(args);
 }
@@ -128,13 +137,13 @@ void interrupt_handler(int val)
 int main(int argc, char **argv)
 {
 	int c, ret;
-	char *indir = NULL, *outdir = NULL, *confile = NULL;
+	char *indir = NULL, *outdir = NULL, *confile = NULL, *kernel = NULL;
 	converter_params_t conv_params;
 
 	while (1) {
 		int option_index = 0;
 
-		c = getopt_long(argc, argv, "qhi:o:c:", cmd_long_options, &option_index);
+		c = getopt_long(argc, argv, "qvhi:o:c:k:", cmd_long_options, &option_index);
 
 		if (c == -1) {
 			break;
@@ -145,6 +154,12 @@ int main(int argc, char **argv)
 				QUIET_FLAG = 1;
 				break;
 
+			case 'v':
+				if (VERBOSE_LEVEL < LOG_LEVEL_TRACE) {
+					VERBOSE_LEVEL++;
+				}
+				break;
+
 			case 'h':
 				show_help();
 				return 0;
@@ -161,6 +176,10 @@ int main(int argc, char **argv)
 				confile = optarg;
 				break;
 
+			case 'k':
+				kernel = optarg;
+				break;
+
 			case '?':
 				show_help();
 				return -1;
@@ -200,6 +219,17 @@ int main(int argc, char **argv)
 		strcpy(conv_params.outpath, outdir);
 	}
 
+	memset(conv_params.kernel, 0, sizeof(conv_params.kernel));
+
+	if (kernel != NULL) {
+		if (strlen(kernel) >= sizeof(conv_params.kernel) || pixel_kernels_select(kernel) != 0) {
+			fprintf(stderr, "Pixel kernels %s are unknown or not supported by this CPU\n", kernel);
+			return -1;
+		}
+
+		strcpy(conv_params.kernel, kernel);
+	}
+
 	if (!is_file_exist(conv_params.inpath)) {
 		fprintf(stderr, "Path %s doesn't exists\n", conv_params.inpath);
 		return -1;
@@ -215,6 +245,7 @@ int main(int argc, char **argv)
 	conv_params.progress.progr_setup = &progress_setup;
 	conv_params.progress.progr_update = &progress_update;
 
+	conv_params.log_level = QUIET_FLAG ? LOG_LEVEL_NONE : VERBOSE_LEVEL;
 	conv_params.logger_arg = NULL;
 	conv_params.logger_msg = &logger_msg;
 
@@ -228,6 +259,8 @@ int main(int argc, char **argv)
 
 	printf("Staring converter (press Ctrl-C to terminate procedure) ...\n\n");
 
+	LOG_RING = log_ring_create(LOG_RING_CAPACITY, &logger_print, NULL);
+
 	RUN_FLAG = 1;
 	signal(SIGINT, interrupt_handler);
 
@@ -239,6 +272,9 @@ int main(int argc, char **argv)
 
 	converter_stop(&conv_params);
 
+	log_ring_free(LOG_RING);
+	LOG_RING = NULL;
+
 	if (QUIET_FLAG) {
 		printf("\n");
 	}
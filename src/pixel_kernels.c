@@ -0,0 +1,1343 @@
+/* 
+   pixel_kernels.c
+    - pixel loops over the decoded 16-bit RGB image
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <string.h>
+#include "pixel_kernels.h"
+
+#if (defined(__x86_64__) || defined(__i386__)) && defined(__GNUC__)
+#define PIXEL_KERNELS_X86
+#include <immintrin.h>
+#elif defined(__ARM_NEON)
+#include <arm_neon.h>
+#endif
+
+/* x86 targets with FMA would fuse the multiply and add of the float kernels, results must not depend on the CPU */
+#if defined(__GNUC__) && !defined(__clang__)
+#pragma GCC optimize ("fp-contract=off")
+#endif
+
+/* grayscale is computed over the blocks of deinterleaved pixels which stay in L1 */
+#define GRAY_BLOCK_PIXELS 512
+
+typedef void (*deinterleave_rgb48_fn)(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue, size_t pixels);
+typedef void (*rgb48_to_gray_fn)(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw);
+typedef void (*planar_to_gray_fn)(const uint16_t *red, const uint16_t *green, const uint16_t *blue,
+										uint16_t *dst, size_t pixels, const gray_weights_t *gw);
+
+typedef void (*deinterleave_rgb48_f32_fn)(const uint16_t *src, float *red, float *green, float *blue,
+										size_t pixels, float scale);
+typedef void (*rgb48_to_f32_fn)(const uint16_t *src, float *dst, size_t pixels, const float *mul);
+typedef void (*u16_to_f32_fn)(const uint16_t *src, float *dst, size_t pixels, float scale);
+typedef void (*u16_to_fits_fn)(const uint16_t *src, uint16_t *dst, size_t pixels);
+
+typedef struct pixel_kernels {
+	const char *name;
+	int (*supported)(void);
+	rgb48_to_gray_fn rgb48_to_gray;
+	deinterleave_rgb48_fn deinterleave_rgb48_fits;
+	rgb48_to_gray_fn rgb48_to_gray_fits;
+	deinterleave_rgb48_f32_fn deinterleave_rgb48_f32;
+	rgb48_to_f32_fn rgb48_to_f32;
+	u16_to_f32_fn u16_to_f32;
+	u16_to_fits_fn u16_to_fits;
+} pixel_kernels_t;
+
+/* 
+   FITS keeps unsigned 16-bit pixels as big-endian signed ones with BZERO = 32768,
+   the "fits" kernels store the pixels in this order and the data is written as is.
+ */
+static inline uint16_t fits_u16(uint16_t val)
+{
+	val ^= 0x8000;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	val = (uint16_t) ((val << 8) | (val >> 8));
+#endif
+
+	return val;
+}
+
+/* every kernel is inlined twice, the fits flag is a constant in both copies */
+static inline __attribute__((always_inline)) void deinterleave_rgb48_scalar_impl(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue,
+											size_t pixels, const int fits)
+{
+	size_t i;
+
+	for (i = 0; i < pixels; i++) {
+		red[i] = fits ? fits_u16(src[0]) : src[0];
+		green[i] = fits ? fits_u16(src[1]) : src[1];
+		blue[i] = fits ? fits_u16(src[2]) : src[2];
+
+		src += 3;
+	}
+}
+
+static void deinterleave_rgb48_scalar(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue, size_t pixels)
+{
+	deinterleave_rgb48_scalar_impl(src, red, green, blue, pixels, 0);
+}
+
+static void deinterleave_rgb48_fits_scalar(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue, size_t pixels)
+{
+	deinterleave_rgb48_scalar_impl(src, red, green, blue, pixels, 1);
+}
+
+/* 
+   Grayscale pixel is (wr * r + wg * g + wb * b) / (wr + wg + wb), rounded down.
+   Division is replaced by multiplication with reciprocal of the weights sum, shift is selected
+   so the result is exact for any 16-bit input, i.e. equal weights give the same value as (r + g + b) / 3.
+ */
+int gray_weights_init(gray_weights_t *gw, unsigned int red, unsigned int green, unsigned int blue)
+{
+	uint64_t sum = (uint64_t) red + green + blue;
+	uint64_t mul;
+	int shift = 0;
+
+	if (sum == 0 || red > UINT16_MAX || green > UINT16_MAX || blue > UINT16_MAX) {
+		return -1;
+	}
+
+	/* error of the reciprocal is below sum, weighted sum of the pixel is below 65536 * sum */
+	while ((UINT64_C(65535) * sum * (sum - 1)) >> shift) {
+		shift++;
+	}
+
+	mul = ((UINT64_C(1) << shift) + sum - 1) / sum;
+
+	if (mul > UINT32_MAX) {
+		return -1;
+	}
+
+	gw->w[0] = red;
+	gw->w[1] = green;
+	gw->w[2] = blue;
+	gw->mul = mul;
+	gw->shift = shift;
+
+	return 0;
+}
+
+static inline __attribute__((always_inline)) void rgb48_to_gray_scalar_impl(const uint16_t *src, uint16_t *dst, size_t pixels,
+											const gray_weights_t *gw, const int fits)
+{
+	size_t i;
+	uint32_t acc;
+	uint16_t val;
+
+	for (i = 0; i < pixels; i++) {
+		acc = (uint32_t) src[0] * gw->w[0] + (uint32_t) src[1] * gw->w[1] + (uint32_t) src[2] * gw->w[2];
+		val = ((uint64_t) acc * gw->mul) >> gw->shift;
+		dst[i] = fits ? fits_u16(val) : val;
+
+		src += 3;
+	}
+}
+
+static void rgb48_to_gray_scalar(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_scalar_impl(src, dst, pixels, gw, 0);
+}
+
+static void rgb48_to_gray_fits_scalar(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_scalar_impl(src, dst, pixels, gw, 1);
+}
+
+/* 
+   Float kernels multiply and add in the same order in every instruction set without FMA,
+   so all of them give the same result as the scalar ones.
+ */
+static void deinterleave_rgb48_f32_scalar(const uint16_t *src, float *red, float *green, float *blue,
+											size_t pixels, float scale)
+{
+	size_t i;
+
+	for (i = 0; i < pixels; i++) {
+		red[i] = src[0] * scale;
+		green[i] = src[1] * scale;
+		blue[i] = src[2] * scale;
+
+		src += 3;
+	}
+}
+
+static void rgb48_to_f32_scalar(const uint16_t *src, float *dst, size_t pixels, const float *mul)
+{
+	size_t i;
+	float acc;
+
+	for (i = 0; i < pixels; i++) {
+		acc = src[0] * mul[0];
+		acc = acc + src[1] * mul[1];
+		dst[i] = acc + src[2] * mul[2];
+
+		src += 3;
+	}
+}
+
+static void u16_to_f32_scalar(const uint16_t *src, float *dst, size_t pixels, float scale)
+{
+	size_t i;
+
+	for (i = 0; i < pixels; i++) {
+		dst[i] = src[i] * scale;
+	}
+}
+
+static void u16_to_fits_scalar(const uint16_t *src, uint16_t *dst, size_t pixels)
+{
+	size_t i;
+
+	for (i = 0; i < pixels; i++) {
+		dst[i] = fits_u16(src[i]);
+	}
+}
+
+/* 
+   Without a byte shuffle the image is deinterleaved block by block into the stack buffers
+   and the planar kernel takes the block from L1. The rest of the block is done by the tail function.
+ */
+static void rgb48_to_gray_blocks(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw,
+					deinterleave_rgb48_fn deinterleave, planar_to_gray_fn planar_to_gray,
+					rgb48_to_gray_fn rgb48_to_gray_tail, size_t vec_pixels)
+{
+	uint16_t red[GRAY_BLOCK_PIXELS] __attribute__((aligned(64)));
+	uint16_t green[GRAY_BLOCK_PIXELS] __attribute__((aligned(64)));
+	uint16_t blue[GRAY_BLOCK_PIXELS] __attribute__((aligned(64)));
+	size_t block, block_vec;
+
+	while (pixels) {
+		block = pixels < GRAY_BLOCK_PIXELS ? pixels : GRAY_BLOCK_PIXELS;
+		block_vec = block - block % vec_pixels;
+
+		deinterleave(src, red, green, blue, block_vec);
+		planar_to_gray(red, green, blue, dst, block_vec, gw);
+
+		rgb48_to_gray_tail(src + block_vec * 3, dst + block_vec, block - block_vec, gw);
+
+		src += block * 3;
+		dst += block;
+		pixels -= block;
+	}
+}
+
+#if defined(PIXEL_KERNELS_X86)
+
+/* 
+   x86 kernels are built for their own instruction set regardless of the compiler flags,
+   pixel_kernels_select() checks the CPU before any of them is used.
+ */
+
+static int cpu_has_sse2(void)
+{
+	return __builtin_cpu_supports("sse2");
+}
+
+static int cpu_has_ssse3(void)
+{
+	return __builtin_cpu_supports("ssse3");
+}
+
+static int cpu_has_avx2(void)
+{
+	return __builtin_cpu_supports("avx2");
+}
+
+static int cpu_has_avx512(void)
+{
+	return __builtin_cpu_supports("avx512f") && __builtin_cpu_supports("avx512bw");
+}
+
+/* SSE2: weighted sum and the reciprocal multiply, 8 pixels per iteration */
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) __m128i gray_div_epu32_sse2(__m128i acc, __m128i mul, __m128i shift)
+{
+	__m128i even = _mm_srl_epi64(_mm_mul_epu32(acc, mul), shift);
+	__m128i odd = _mm_srl_epi64(_mm_mul_epu32(_mm_srli_epi64(acc, 32), mul), shift);
+
+	acc = _mm_or_si128(even, _mm_slli_epi64(odd, 32));
+
+	/* values fit 16 bits, sign extension keeps them intact through the signed pack */
+	return _mm_srai_epi32(_mm_slli_epi32(acc, 16), 16);
+}
+
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void gray_madd_epu16_sse2(__m128i px, __m128i w, __m128i *acc_lo, __m128i *acc_hi)
+{
+	__m128i lo = _mm_mullo_epi16(px, w);
+	__m128i hi = _mm_mulhi_epu16(px, w);
+
+	*acc_lo = _mm_add_epi32(*acc_lo, _mm_unpacklo_epi16(lo, hi));
+	*acc_hi = _mm_add_epi32(*acc_hi, _mm_unpackhi_epi16(lo, hi));
+}
+
+/* sign bit is flipped and the bytes of every word are swapped, x86 is little-endian */
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) __m128i fits_epu16_sse2(__m128i px)
+{
+	px = _mm_xor_si128(px, _mm_set1_epi16((short) 0x8000));
+
+	return _mm_or_si128(_mm_slli_epi16(px, 8), _mm_srli_epi16(px, 8));
+}
+
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void planar_to_gray_sse2_impl(const uint16_t *red, const uint16_t *green, const uint16_t *blue,
+										uint16_t *dst, size_t pixels, const gray_weights_t *gw, const int fits)
+{
+	size_t i;
+	__m128i acc_lo, acc_hi, gray;
+
+	const __m128i wr = _mm_set1_epi16((short) gw->w[0]);
+	const __m128i wg = _mm_set1_epi16((short) gw->w[1]);
+	const __m128i wb = _mm_set1_epi16((short) gw->w[2]);
+	const __m128i mul = _mm_set1_epi32((int) gw->mul);
+	const __m128i shift = _mm_cvtsi32_si128(gw->shift);
+
+	for (i = 0; i < pixels; i += 8) {
+		acc_lo = _mm_setzero_si128();
+		acc_hi = _mm_setzero_si128();
+
+		gray_madd_epu16_sse2(_mm_loadu_si128((const __m128i *) (red + i)), wr, &acc_lo, &acc_hi);
+		gray_madd_epu16_sse2(_mm_loadu_si128((const __m128i *) (green + i)), wg, &acc_lo, &acc_hi);
+		gray_madd_epu16_sse2(_mm_loadu_si128((const __m128i *) (blue + i)), wb, &acc_lo, &acc_hi);
+
+		gray = _mm_packs_epi32(gray_div_epu32_sse2(acc_lo, mul, shift), gray_div_epu32_sse2(acc_hi, mul, shift));
+
+		_mm_storeu_si128((__m128i *) (dst + i), fits ? fits_epu16_sse2(gray) : gray);
+	}
+}
+
+__attribute__((target("sse2")))
+static void planar_to_gray_sse2(const uint16_t *red, const uint16_t *green, const uint16_t *blue,
+										uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	planar_to_gray_sse2_impl(red, green, blue, dst, pixels, gw, 0);
+}
+
+__attribute__((target("sse2")))
+static void planar_to_gray_fits_sse2(const uint16_t *red, const uint16_t *green, const uint16_t *blue,
+										uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	planar_to_gray_sse2_impl(red, green, blue, dst, pixels, gw, 1);
+}
+
+static void rgb48_to_gray_sse2(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_blocks(src, dst, pixels, gw, deinterleave_rgb48_scalar, planar_to_gray_sse2, rgb48_to_gray_scalar, 8);
+}
+
+static void rgb48_to_gray_fits_sse2(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_blocks(src, dst, pixels, gw, deinterleave_rgb48_scalar, planar_to_gray_fits_sse2,
+											rgb48_to_gray_fits_scalar, 8);
+}
+
+/* shuffles which pick words of one channel from each of the three source vectors, 8 pixels */
+static const int8_t RGB48_SHUFFLE[9][16] __attribute__((aligned(16))) = {
+	{  0,  1,  6,  7, 12, 13, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+	{ -1, -1, -1, -1, -1, -1,  2,  3,  8,  9, 14, 15, -1, -1, -1, -1 },
+	{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  4,  5, 10, 11 },
+	{  2,  3,  8,  9, 14, 15, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+	{ -1, -1, -1, -1, -1, -1,  4,  5, 10, 11, -1, -1, -1, -1, -1, -1 },
+	{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  0,  1,  6,  7, 12, 13 },
+	{  4,  5, 10, 11, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1, -1 },
+	{ -1, -1, -1, -1,  0,  1,  6,  7, 12, 13, -1, -1, -1, -1, -1, -1 },
+	{ -1, -1, -1, -1, -1, -1, -1, -1, -1, -1,  2,  3,  8,  9, 14, 15 }
+};
+
+/* SSSE3: 8 pixels (three 16-byte vectors) are split into R, G and B vectors in registers */
+__attribute__((target("ssse3")))
+static inline __attribute__((always_inline)) void split_rgb48_ssse3(const uint16_t *src, const __m128i *m, __m128i *rgb)
+{
+	__m128i v0 = _mm_loadu_si128((const __m128i *) src);
+	__m128i v1 = _mm_loadu_si128((const __m128i *) (src + 8));
+	__m128i v2 = _mm_loadu_si128((const __m128i *) (src + 16));
+	int c;
+
+	for (c = 0; c < 3; c++) {
+		rgb[c] = _mm_or_si128(_mm_or_si128(_mm_shuffle_epi8(v0, m[c * 3]),
+					_mm_shuffle_epi8(v1, m[c * 3 + 1])), _mm_shuffle_epi8(v2, m[c * 3 + 2]));
+	}
+}
+
+__attribute__((target("ssse3")))
+static inline __attribute__((always_inline)) void deinterleave_rgb48_ssse3_impl(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue,
+											size_t pixels, const int fits)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+	__m128i m[9], rgb[3];
+	int c;
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]);
+	}
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		split_rgb48_ssse3(src + i * 3, m, rgb);
+
+		if (fits) {
+			for (c = 0; c < 3; c++) {
+				rgb[c] = fits_epu16_sse2(rgb[c]);
+			}
+		}
+
+		_mm_storeu_si128((__m128i *) (red + i), rgb[0]);
+		_mm_storeu_si128((__m128i *) (green + i), rgb[1]);
+		_mm_storeu_si128((__m128i *) (blue + i), rgb[2]);
+	}
+
+	deinterleave_rgb48_scalar_impl(src + vec_pixels * 3, red + vec_pixels, green + vec_pixels, blue + vec_pixels,
+											pixels - vec_pixels, fits);
+}
+
+__attribute__((target("ssse3")))
+static void deinterleave_rgb48_fits_ssse3(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue, size_t pixels)
+{
+	deinterleave_rgb48_ssse3_impl(src, red, green, blue, pixels, 1);
+}
+
+/* split channels go straight to the weighted sum, image is read once */
+__attribute__((target("ssse3")))
+static inline __attribute__((always_inline)) void rgb48_to_gray_ssse3_impl(const uint16_t *src, uint16_t *dst, size_t pixels,
+											const gray_weights_t *gw, const int fits)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+	__m128i m[9], rgb[3], acc_lo, acc_hi, gray;
+	int c;
+
+	const __m128i wr = _mm_set1_epi16((short) gw->w[0]);
+	const __m128i wg = _mm_set1_epi16((short) gw->w[1]);
+	const __m128i wb = _mm_set1_epi16((short) gw->w[2]);
+	const __m128i mul = _mm_set1_epi32((int) gw->mul);
+	const __m128i shift = _mm_cvtsi32_si128(gw->shift);
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]);
+	}
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		split_rgb48_ssse3(src + i * 3, m, rgb);
+
+		acc_lo = _mm_setzero_si128();
+		acc_hi = _mm_setzero_si128();
+
+		gray_madd_epu16_sse2(rgb[0], wr, &acc_lo, &acc_hi);
+		gray_madd_epu16_sse2(rgb[1], wg, &acc_lo, &acc_hi);
+		gray_madd_epu16_sse2(rgb[2], wb, &acc_lo, &acc_hi);
+
+		gray = _mm_packs_epi32(gray_div_epu32_sse2(acc_lo, mul, shift), gray_div_epu32_sse2(acc_hi, mul, shift));
+
+		_mm_storeu_si128((__m128i *) (dst + i), fits ? fits_epu16_sse2(gray) : gray);
+	}
+
+	rgb48_to_gray_scalar_impl(src + vec_pixels * 3, dst + vec_pixels, pixels - vec_pixels, gw, fits);
+}
+
+__attribute__((target("ssse3")))
+static void rgb48_to_gray_ssse3(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_ssse3_impl(src, dst, pixels, gw, 0);
+}
+
+__attribute__((target("ssse3")))
+static void rgb48_to_gray_fits_ssse3(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_ssse3_impl(src, dst, pixels, gw, 1);
+}
+
+/* 
+   AVX2 and AVX-512 shuffle within 128-bit lanes, so every lane gets its own group of 8 pixels
+   and the SSSE3 masks are reused as is. Pack and unpack are per lane as well and keep pixel order.
+ */
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) __m256i load_rgb48_lanes_avx2(const uint16_t *src)
+{
+	return _mm256_inserti128_si256(_mm256_castsi128_si256(_mm_loadu_si128((const __m128i *) src)),
+										_mm_loadu_si128((const __m128i *) (src + 24)), 1);
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void split_rgb48_avx2(const uint16_t *src, const __m256i *m, __m256i *rgb)
+{
+	__m256i v0 = load_rgb48_lanes_avx2(src);
+	__m256i v1 = load_rgb48_lanes_avx2(src + 8);
+	__m256i v2 = load_rgb48_lanes_avx2(src + 16);
+	int c;
+
+	for (c = 0; c < 3; c++) {
+		rgb[c] = _mm256_or_si256(_mm256_or_si256(_mm256_shuffle_epi8(v0, m[c * 3]),
+					_mm256_shuffle_epi8(v1, m[c * 3 + 1])), _mm256_shuffle_epi8(v2, m[c * 3 + 2]));
+	}
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) __m256i fits_epu16_avx2(__m256i px)
+{
+	px = _mm256_xor_si256(px, _mm256_set1_epi16((short) 0x8000));
+
+	return _mm256_or_si256(_mm256_slli_epi16(px, 8), _mm256_srli_epi16(px, 8));
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void deinterleave_rgb48_avx2_impl(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue,
+											size_t pixels, const int fits)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 15;
+	__m256i m[9], rgb[3];
+	int c;
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]));
+	}
+
+	for (i = 0; i < vec_pixels; i += 16) {
+		split_rgb48_avx2(src + i * 3, m, rgb);
+
+		if (fits) {
+			for (c = 0; c < 3; c++) {
+				rgb[c] = fits_epu16_avx2(rgb[c]);
+			}
+		}
+
+		_mm256_storeu_si256((__m256i *) (red + i), rgb[0]);
+		_mm256_storeu_si256((__m256i *) (green + i), rgb[1]);
+		_mm256_storeu_si256((__m256i *) (blue + i), rgb[2]);
+	}
+
+	deinterleave_rgb48_ssse3_impl(src + vec_pixels * 3, red + vec_pixels, green + vec_pixels, blue + vec_pixels,
+											pixels - vec_pixels, fits);
+}
+
+__attribute__((target("avx2")))
+static void deinterleave_rgb48_fits_avx2(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue, size_t pixels)
+{
+	deinterleave_rgb48_avx2_impl(src, red, green, blue, pixels, 1);
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) __m256i gray_div_epu32_avx2(__m256i acc, __m256i mul, __m128i shift)
+{
+	__m256i even = _mm256_srl_epi64(_mm256_mul_epu32(acc, mul), shift);
+	__m256i odd = _mm256_srl_epi64(_mm256_mul_epu32(_mm256_srli_epi64(acc, 32), mul), shift);
+
+	acc = _mm256_or_si256(even, _mm256_slli_epi64(odd, 32));
+
+	return _mm256_srai_epi32(_mm256_slli_epi32(acc, 16), 16);
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void gray_madd_epu16_avx2(__m256i px, __m256i w, __m256i *acc_lo, __m256i *acc_hi)
+{
+	__m256i lo = _mm256_mullo_epi16(px, w);
+	__m256i hi = _mm256_mulhi_epu16(px, w);
+
+	*acc_lo = _mm256_add_epi32(*acc_lo, _mm256_unpacklo_epi16(lo, hi));
+	*acc_hi = _mm256_add_epi32(*acc_hi, _mm256_unpackhi_epi16(lo, hi));
+}
+
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void rgb48_to_gray_avx2_impl(const uint16_t *src, uint16_t *dst, size_t pixels,
+											const gray_weights_t *gw, const int fits)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 15;
+	__m256i m[9], rgb[3], acc_lo, acc_hi, gray;
+	int c;
+
+	const __m256i wr = _mm256_set1_epi16((short) gw->w[0]);
+	const __m256i wg = _mm256_set1_epi16((short) gw->w[1]);
+	const __m256i wb = _mm256_set1_epi16((short) gw->w[2]);
+	const __m256i mul = _mm256_set1_epi32((int) gw->mul);
+	const __m128i shift = _mm_cvtsi32_si128(gw->shift);
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]));
+	}
+
+	for (i = 0; i < vec_pixels; i += 16) {
+		split_rgb48_avx2(src + i * 3, m, rgb);
+
+		acc_lo = _mm256_setzero_si256();
+		acc_hi = _mm256_setzero_si256();
+
+		gray_madd_epu16_avx2(rgb[0], wr, &acc_lo, &acc_hi);
+		gray_madd_epu16_avx2(rgb[1], wg, &acc_lo, &acc_hi);
+		gray_madd_epu16_avx2(rgb[2], wb, &acc_lo, &acc_hi);
+
+		gray = _mm256_packs_epi32(gray_div_epu32_avx2(acc_lo, mul, shift), gray_div_epu32_avx2(acc_hi, mul, shift));
+
+		_mm256_storeu_si256((__m256i *) (dst + i), fits ? fits_epu16_avx2(gray) : gray);
+	}
+
+	rgb48_to_gray_ssse3_impl(src + vec_pixels * 3, dst + vec_pixels, pixels - vec_pixels, gw, fits);
+}
+
+__attribute__((target("avx2")))
+static void rgb48_to_gray_avx2(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_avx2_impl(src, dst, pixels, gw, 0);
+}
+
+__attribute__((target("avx2")))
+static void rgb48_to_gray_fits_avx2(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_avx2_impl(src, dst, pixels, gw, 1);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __attribute__((always_inline)) __m512i load_rgb48_lanes_avx512(const uint16_t *src)
+{
+	__m512i v = _mm512_castsi128_si512(_mm_loadu_si128((const __m128i *) src));
+
+	v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *) (src + 24)), 1);
+	v = _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *) (src + 48)), 2);
+
+	return _mm512_inserti32x4(v, _mm_loadu_si128((const __m128i *) (src + 72)), 3);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __attribute__((always_inline)) void split_rgb48_avx512(const uint16_t *src, const __m512i *m, __m512i *rgb)
+{
+	__m512i v0 = load_rgb48_lanes_avx512(src);
+	__m512i v1 = load_rgb48_lanes_avx512(src + 8);
+	__m512i v2 = load_rgb48_lanes_avx512(src + 16);
+	int c;
+
+	for (c = 0; c < 3; c++) {
+		rgb[c] = _mm512_or_si512(_mm512_or_si512(_mm512_shuffle_epi8(v0, m[c * 3]),
+					_mm512_shuffle_epi8(v1, m[c * 3 + 1])), _mm512_shuffle_epi8(v2, m[c * 3 + 2]));
+	}
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __attribute__((always_inline)) __m512i fits_epu16_avx512(__m512i px)
+{
+	px = _mm512_xor_si512(px, _mm512_set1_epi16((short) 0x8000));
+
+	return _mm512_or_si512(_mm512_slli_epi16(px, 8), _mm512_srli_epi16(px, 8));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __attribute__((always_inline)) void deinterleave_rgb48_avx512_impl(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue,
+											size_t pixels, const int fits)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 31;
+	__m512i m[9], rgb[3];
+	int c;
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]));
+	}
+
+	for (i = 0; i < vec_pixels; i += 32) {
+		split_rgb48_avx512(src + i * 3, m, rgb);
+
+		if (fits) {
+			for (c = 0; c < 3; c++) {
+				rgb[c] = fits_epu16_avx512(rgb[c]);
+			}
+		}
+
+		_mm512_storeu_si512((void *) (red + i), rgb[0]);
+		_mm512_storeu_si512((void *) (green + i), rgb[1]);
+		_mm512_storeu_si512((void *) (blue + i), rgb[2]);
+	}
+
+	deinterleave_rgb48_ssse3_impl(src + vec_pixels * 3, red + vec_pixels, green + vec_pixels, blue + vec_pixels,
+											pixels - vec_pixels, fits);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void deinterleave_rgb48_fits_avx512(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue, size_t pixels)
+{
+	deinterleave_rgb48_avx512_impl(src, red, green, blue, pixels, 1);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __attribute__((always_inline)) __m512i gray_div_epu32_avx512(__m512i acc, __m512i mul, __m128i shift)
+{
+	__m512i even = _mm512_srl_epi64(_mm512_mul_epu32(acc, mul), shift);
+	__m512i odd = _mm512_srl_epi64(_mm512_mul_epu32(_mm512_srli_epi64(acc, 32), mul), shift);
+
+	acc = _mm512_or_si512(even, _mm512_slli_epi64(odd, 32));
+
+	return _mm512_srai_epi32(_mm512_slli_epi32(acc, 16), 16);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __attribute__((always_inline)) void gray_madd_epu16_avx512(__m512i px, __m512i w, __m512i *acc_lo, __m512i *acc_hi)
+{
+	__m512i lo = _mm512_mullo_epi16(px, w);
+	__m512i hi = _mm512_mulhi_epu16(px, w);
+
+	*acc_lo = _mm512_add_epi32(*acc_lo, _mm512_unpacklo_epi16(lo, hi));
+	*acc_hi = _mm512_add_epi32(*acc_hi, _mm512_unpackhi_epi16(lo, hi));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __attribute__((always_inline)) void rgb48_to_gray_avx512_impl(const uint16_t *src, uint16_t *dst, size_t pixels,
+											const gray_weights_t *gw, const int fits)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 31;
+	__m512i m[9], rgb[3], acc_lo, acc_hi, gray;
+	int c;
+
+	const __m512i wr = _mm512_set1_epi16((short) gw->w[0]);
+	const __m512i wg = _mm512_set1_epi16((short) gw->w[1]);
+	const __m512i wb = _mm512_set1_epi16((short) gw->w[2]);
+	const __m512i mul = _mm512_set1_epi32((int) gw->mul);
+	const __m128i shift = _mm_cvtsi32_si128(gw->shift);
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]));
+	}
+
+	for (i = 0; i < vec_pixels; i += 32) {
+		split_rgb48_avx512(src + i * 3, m, rgb);
+
+		acc_lo = _mm512_setzero_si512();
+		acc_hi = _mm512_setzero_si512();
+
+		gray_madd_epu16_avx512(rgb[0], wr, &acc_lo, &acc_hi);
+		gray_madd_epu16_avx512(rgb[1], wg, &acc_lo, &acc_hi);
+		gray_madd_epu16_avx512(rgb[2], wb, &acc_lo, &acc_hi);
+
+		gray = _mm512_packs_epi32(gray_div_epu32_avx512(acc_lo, mul, shift), gray_div_epu32_avx512(acc_hi, mul, shift));
+
+		_mm512_storeu_si512((void *) (dst + i), fits ? fits_epu16_avx512(gray) : gray);
+	}
+
+	rgb48_to_gray_ssse3_impl(src + vec_pixels * 3, dst + vec_pixels, pixels - vec_pixels, gw, fits);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void rgb48_to_gray_avx512(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_avx512_impl(src, dst, pixels, gw, 0);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void rgb48_to_gray_fits_avx512(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_avx512_impl(src, dst, pixels, gw, 1);
+}
+
+/* SSE2: 8 pixels are widened to 32 bits by the unpack with zero and converted */
+__attribute__((target("sse2")))
+static inline __attribute__((always_inline)) void cvt_epu16_ps_sse2(__m128i px, __m128 *lo, __m128 *hi)
+{
+	const __m128i zero = _mm_setzero_si128();
+
+	*lo = _mm_cvtepi32_ps(_mm_unpacklo_epi16(px, zero));
+	*hi = _mm_cvtepi32_ps(_mm_unpackhi_epi16(px, zero));
+}
+
+__attribute__((target("sse2")))
+static void u16_to_f32_sse2(const uint16_t *src, float *dst, size_t pixels, float scale)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+	const __m128 s = _mm_set1_ps(scale);
+	__m128 lo, hi;
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		cvt_epu16_ps_sse2(_mm_loadu_si128((const __m128i *) (src + i)), &lo, &hi);
+
+		_mm_storeu_ps(dst + i, _mm_mul_ps(lo, s));
+		_mm_storeu_ps(dst + i + 4, _mm_mul_ps(hi, s));
+	}
+
+	u16_to_f32_scalar(src + vec_pixels, dst + vec_pixels, pixels - vec_pixels, scale);
+}
+
+__attribute__((target("sse2")))
+static void u16_to_fits_sse2(const uint16_t *src, uint16_t *dst, size_t pixels)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		_mm_storeu_si128((__m128i *) (dst + i), fits_epu16_sse2(_mm_loadu_si128((const __m128i *) (src + i))));
+	}
+
+	u16_to_fits_scalar(src + vec_pixels, dst + vec_pixels, pixels - vec_pixels);
+}
+
+/* SSSE3: channels are split in registers and converted right away */
+__attribute__((target("ssse3")))
+static void deinterleave_rgb48_f32_ssse3(const uint16_t *src, float *red, float *green, float *blue,
+											size_t pixels, float scale)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+	float *dst[3] = { red, green, blue };
+	const __m128 s = _mm_set1_ps(scale);
+	__m128i m[9], rgb[3];
+	__m128 lo, hi;
+	int c;
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]);
+	}
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		split_rgb48_ssse3(src + i * 3, m, rgb);
+
+		for (c = 0; c < 3; c++) {
+			cvt_epu16_ps_sse2(rgb[c], &lo, &hi);
+
+			_mm_storeu_ps(dst[c] + i, _mm_mul_ps(lo, s));
+			_mm_storeu_ps(dst[c] + i + 4, _mm_mul_ps(hi, s));
+		}
+	}
+
+	deinterleave_rgb48_f32_scalar(src + vec_pixels * 3, red + vec_pixels, green + vec_pixels, blue + vec_pixels,
+											pixels - vec_pixels, scale);
+}
+
+__attribute__((target("ssse3")))
+static void rgb48_to_f32_ssse3(const uint16_t *src, float *dst, size_t pixels, const float *mul)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+	__m128i m[9], rgb[3];
+	__m128 lo[3], hi[3], w[3];
+	int c;
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]);
+	}
+
+	for (c = 0; c < 3; c++) {
+		w[c] = _mm_set1_ps(mul[c]);
+	}
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		split_rgb48_ssse3(src + i * 3, m, rgb);
+
+		for (c = 0; c < 3; c++) {
+			cvt_epu16_ps_sse2(rgb[c], &lo[c], &hi[c]);
+		}
+
+		_mm_storeu_ps(dst + i, _mm_add_ps(_mm_add_ps(_mm_mul_ps(lo[0], w[0]), _mm_mul_ps(lo[1], w[1])),
+															_mm_mul_ps(lo[2], w[2])));
+		_mm_storeu_ps(dst + i + 4, _mm_add_ps(_mm_add_ps(_mm_mul_ps(hi[0], w[0]), _mm_mul_ps(hi[1], w[1])),
+															_mm_mul_ps(hi[2], w[2])));
+	}
+
+	rgb48_to_f32_scalar(src + vec_pixels * 3, dst + vec_pixels, pixels - vec_pixels, mul);
+}
+
+/* lanes of the split vectors hold the pixels in order, low and high halves give 8 pixels each */
+__attribute__((target("avx2")))
+static inline __attribute__((always_inline)) void cvt_epu16_ps_avx2(__m256i px, __m256 *lo, __m256 *hi)
+{
+	*lo = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_castsi256_si128(px)));
+	*hi = _mm256_cvtepi32_ps(_mm256_cvtepu16_epi32(_mm256_extracti128_si256(px, 1)));
+}
+
+__attribute__((target("avx2")))
+static void u16_to_f32_avx2(const uint16_t *src, float *dst, size_t pixels, float scale)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 15;
+	const __m256 s = _mm256_set1_ps(scale);
+	__m256 lo, hi;
+
+	for (i = 0; i < vec_pixels; i += 16) {
+		cvt_epu16_ps_avx2(_mm256_loadu_si256((const __m256i *) (src + i)), &lo, &hi);
+
+		_mm256_storeu_ps(dst + i, _mm256_mul_ps(lo, s));
+		_mm256_storeu_ps(dst + i + 8, _mm256_mul_ps(hi, s));
+	}
+
+	u16_to_f32_sse2(src + vec_pixels, dst + vec_pixels, pixels - vec_pixels, scale);
+}
+
+__attribute__((target("avx2")))
+static void u16_to_fits_avx2(const uint16_t *src, uint16_t *dst, size_t pixels)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 15;
+
+	for (i = 0; i < vec_pixels; i += 16) {
+		_mm256_storeu_si256((__m256i *) (dst + i), fits_epu16_avx2(_mm256_loadu_si256((const __m256i *) (src + i))));
+	}
+
+	u16_to_fits_sse2(src + vec_pixels, dst + vec_pixels, pixels - vec_pixels);
+}
+
+__attribute__((target("avx2")))
+static void deinterleave_rgb48_f32_avx2(const uint16_t *src, float *red, float *green, float *blue,
+											size_t pixels, float scale)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 15;
+	float *dst[3] = { red, green, blue };
+	const __m256 s = _mm256_set1_ps(scale);
+	__m256i m[9], rgb[3];
+	__m256 lo, hi;
+	int c;
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]));
+	}
+
+	for (i = 0; i < vec_pixels; i += 16) {
+		split_rgb48_avx2(src + i * 3, m, rgb);
+
+		for (c = 0; c < 3; c++) {
+			cvt_epu16_ps_avx2(rgb[c], &lo, &hi);
+
+			_mm256_storeu_ps(dst[c] + i, _mm256_mul_ps(lo, s));
+			_mm256_storeu_ps(dst[c] + i + 8, _mm256_mul_ps(hi, s));
+		}
+	}
+
+	deinterleave_rgb48_f32_ssse3(src + vec_pixels * 3, red + vec_pixels, green + vec_pixels, blue + vec_pixels,
+											pixels - vec_pixels, scale);
+}
+
+__attribute__((target("avx2")))
+static void rgb48_to_f32_avx2(const uint16_t *src, float *dst, size_t pixels, const float *mul)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 15;
+	__m256i m[9], rgb[3];
+	__m256 lo[3], hi[3], w[3];
+	int c;
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm256_broadcastsi128_si256(_mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]));
+	}
+
+	for (c = 0; c < 3; c++) {
+		w[c] = _mm256_set1_ps(mul[c]);
+	}
+
+	for (i = 0; i < vec_pixels; i += 16) {
+		split_rgb48_avx2(src + i * 3, m, rgb);
+
+		for (c = 0; c < 3; c++) {
+			cvt_epu16_ps_avx2(rgb[c], &lo[c], &hi[c]);
+		}
+
+		_mm256_storeu_ps(dst + i, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(lo[0], w[0]),
+										_mm256_mul_ps(lo[1], w[1])), _mm256_mul_ps(lo[2], w[2])));
+		_mm256_storeu_ps(dst + i + 8, _mm256_add_ps(_mm256_add_ps(_mm256_mul_ps(hi[0], w[0]),
+										_mm256_mul_ps(hi[1], w[1])), _mm256_mul_ps(hi[2], w[2])));
+	}
+
+	rgb48_to_f32_ssse3(src + vec_pixels * 3, dst + vec_pixels, pixels - vec_pixels, mul);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static inline __attribute__((always_inline)) void cvt_epu16_ps_avx512(__m512i px, __m512 *lo, __m512 *hi)
+{
+	*lo = _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm512_castsi512_si256(px)));
+	*hi = _mm512_cvtepi32_ps(_mm512_cvtepu16_epi32(_mm512_extracti64x4_epi64(px, 1)));
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void u16_to_f32_avx512(const uint16_t *src, float *dst, size_t pixels, float scale)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 31;
+	const __m512 s = _mm512_set1_ps(scale);
+	__m512 lo, hi;
+
+	for (i = 0; i < vec_pixels; i += 32) {
+		cvt_epu16_ps_avx512(_mm512_loadu_si512((const void *) (src + i)), &lo, &hi);
+
+		_mm512_storeu_ps(dst + i, _mm512_mul_ps(lo, s));
+		_mm512_storeu_ps(dst + i + 16, _mm512_mul_ps(hi, s));
+	}
+
+	u16_to_f32_sse2(src + vec_pixels, dst + vec_pixels, pixels - vec_pixels, scale);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void u16_to_fits_avx512(const uint16_t *src, uint16_t *dst, size_t pixels)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 31;
+
+	for (i = 0; i < vec_pixels; i += 32) {
+		_mm512_storeu_si512((void *) (dst + i), fits_epu16_avx512(_mm512_loadu_si512((const void *) (src + i))));
+	}
+
+	u16_to_fits_sse2(src + vec_pixels, dst + vec_pixels, pixels - vec_pixels);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void deinterleave_rgb48_f32_avx512(const uint16_t *src, float *red, float *green, float *blue,
+											size_t pixels, float scale)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 31;
+	float *dst[3] = { red, green, blue };
+	const __m512 s = _mm512_set1_ps(scale);
+	__m512i m[9], rgb[3];
+	__m512 lo, hi;
+	int c;
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]));
+	}
+
+	for (i = 0; i < vec_pixels; i += 32) {
+		split_rgb48_avx512(src + i * 3, m, rgb);
+
+		for (c = 0; c < 3; c++) {
+			cvt_epu16_ps_avx512(rgb[c], &lo, &hi);
+
+			_mm512_storeu_ps(dst[c] + i, _mm512_mul_ps(lo, s));
+			_mm512_storeu_ps(dst[c] + i + 16, _mm512_mul_ps(hi, s));
+		}
+	}
+
+	deinterleave_rgb48_f32_ssse3(src + vec_pixels * 3, red + vec_pixels, green + vec_pixels, blue + vec_pixels,
+											pixels - vec_pixels, scale);
+}
+
+__attribute__((target("avx512f,avx512bw")))
+static void rgb48_to_f32_avx512(const uint16_t *src, float *dst, size_t pixels, const float *mul)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 31;
+	__m512i m[9], rgb[3];
+	__m512 lo[3], hi[3], w[3];
+	int c;
+
+	for (c = 0; c < 9; c++) {
+		m[c] = _mm512_broadcast_i32x4(_mm_load_si128((const __m128i *) RGB48_SHUFFLE[c]));
+	}
+
+	for (c = 0; c < 3; c++) {
+		w[c] = _mm512_set1_ps(mul[c]);
+	}
+
+	for (i = 0; i < vec_pixels; i += 32) {
+		split_rgb48_avx512(src + i * 3, m, rgb);
+
+		for (c = 0; c < 3; c++) {
+			cvt_epu16_ps_avx512(rgb[c], &lo[c], &hi[c]);
+		}
+
+		_mm512_storeu_ps(dst + i, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(lo[0], w[0]),
+										_mm512_mul_ps(lo[1], w[1])), _mm512_mul_ps(lo[2], w[2])));
+		_mm512_storeu_ps(dst + i + 16, _mm512_add_ps(_mm512_add_ps(_mm512_mul_ps(hi[0], w[0]),
+										_mm512_mul_ps(hi[1], w[1])), _mm512_mul_ps(hi[2], w[2])));
+	}
+
+	rgb48_to_f32_ssse3(src + vec_pixels * 3, dst + vec_pixels, pixels - vec_pixels, mul);
+}
+
+#elif defined(__ARM_NEON)
+
+/* NEON is a part of the base instruction set on the targets where it's enabled by the compiler */
+static int cpu_has_neon(void)
+{
+	return 1;
+}
+
+static inline uint16x8_t fits_u16_neon(uint16x8_t px)
+{
+	px = veorq_u16(px, vdupq_n_u16(0x8000));
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	px = vreinterpretq_u16_u8(vrev16q_u8(vreinterpretq_u8_u16(px)));
+#endif
+
+	return px;
+}
+
+static inline __attribute__((always_inline)) void deinterleave_rgb48_neon_impl(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue,
+											size_t pixels, const int fits)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+	uint16x8x3_t rgb;
+	int c;
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		rgb = vld3q_u16(src + i * 3);
+
+		if (fits) {
+			for (c = 0; c < 3; c++) {
+				rgb.val[c] = fits_u16_neon(rgb.val[c]);
+			}
+		}
+
+		vst1q_u16(red + i, rgb.val[0]);
+		vst1q_u16(green + i, rgb.val[1]);
+		vst1q_u16(blue + i, rgb.val[2]);
+	}
+
+	deinterleave_rgb48_scalar_impl(src + vec_pixels * 3, red + vec_pixels, green + vec_pixels, blue + vec_pixels,
+											pixels - vec_pixels, fits);
+}
+
+static void deinterleave_rgb48_fits_neon(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue, size_t pixels)
+{
+	deinterleave_rgb48_neon_impl(src, red, green, blue, pixels, 1);
+}
+
+static inline uint16x4_t gray_div_u32(uint32x4_t acc, uint32_t mul, int64x2_t shift)
+{
+	uint64x2_t lo = vshlq_u64(vmull_n_u32(vget_low_u32(acc), mul), shift);
+	uint64x2_t hi = vshlq_u64(vmull_n_u32(vget_high_u32(acc), mul), shift);
+
+	return vmovn_u32(vcombine_u32(vmovn_u64(lo), vmovn_u64(hi)));
+}
+
+static inline __attribute__((always_inline)) void rgb48_to_gray_neon_impl(const uint16_t *src, uint16_t *dst, size_t pixels,
+											const gray_weights_t *gw, const int fits)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+	uint16x8x3_t rgb;
+	uint32x4_t acc_lo, acc_hi;
+	uint16x8_t gray;
+
+	const int64x2_t shift = vdupq_n_s64(-gw->shift);
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		rgb = vld3q_u16(src + i * 3);
+
+		acc_lo = vmull_n_u16(vget_low_u16(rgb.val[0]), gw->w[0]);
+		acc_lo = vmlal_n_u16(acc_lo, vget_low_u16(rgb.val[1]), gw->w[1]);
+		acc_lo = vmlal_n_u16(acc_lo, vget_low_u16(rgb.val[2]), gw->w[2]);
+
+		acc_hi = vmull_n_u16(vget_high_u16(rgb.val[0]), gw->w[0]);
+		acc_hi = vmlal_n_u16(acc_hi, vget_high_u16(rgb.val[1]), gw->w[1]);
+		acc_hi = vmlal_n_u16(acc_hi, vget_high_u16(rgb.val[2]), gw->w[2]);
+
+		gray = vcombine_u16(gray_div_u32(acc_lo, gw->mul, shift), gray_div_u32(acc_hi, gw->mul, shift));
+
+		vst1q_u16(dst + i, fits ? fits_u16_neon(gray) : gray);
+	}
+
+	rgb48_to_gray_scalar_impl(src + vec_pixels * 3, dst + vec_pixels, pixels - vec_pixels, gw, fits);
+}
+
+static void rgb48_to_gray_neon(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_neon_impl(src, dst, pixels, gw, 0);
+}
+
+static void rgb48_to_gray_fits_neon(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	rgb48_to_gray_neon_impl(src, dst, pixels, gw, 1);
+}
+
+static inline void cvt_u16_f32(uint16x8_t px, float32x4_t *lo, float32x4_t *hi)
+{
+	*lo = vcvtq_f32_u32(vmovl_u16(vget_low_u16(px)));
+	*hi = vcvtq_f32_u32(vmovl_u16(vget_high_u16(px)));
+}
+
+static void u16_to_f32_neon(const uint16_t *src, float *dst, size_t pixels, float scale)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+	float32x4_t lo, hi;
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		cvt_u16_f32(vld1q_u16(src + i), &lo, &hi);
+
+		vst1q_f32(dst + i, vmulq_n_f32(lo, scale));
+		vst1q_f32(dst + i + 4, vmulq_n_f32(hi, scale));
+	}
+
+	u16_to_f32_scalar(src + vec_pixels, dst + vec_pixels, pixels - vec_pixels, scale);
+}
+
+static void u16_to_fits_neon(const uint16_t *src, uint16_t *dst, size_t pixels)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		vst1q_u16(dst + i, fits_u16_neon(vld1q_u16(src + i)));
+	}
+
+	u16_to_fits_scalar(src + vec_pixels, dst + vec_pixels, pixels - vec_pixels);
+}
+
+static void deinterleave_rgb48_f32_neon(const uint16_t *src, float *red, float *green, float *blue,
+											size_t pixels, float scale)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+	float *dst[3] = { red, green, blue };
+	uint16x8x3_t rgb;
+	float32x4_t lo, hi;
+	int c;
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		rgb = vld3q_u16(src + i * 3);
+
+		for (c = 0; c < 3; c++) {
+			cvt_u16_f32(rgb.val[c], &lo, &hi);
+
+			vst1q_f32(dst[c] + i, vmulq_n_f32(lo, scale));
+			vst1q_f32(dst[c] + i + 4, vmulq_n_f32(hi, scale));
+		}
+	}
+
+	deinterleave_rgb48_f32_scalar(src + vec_pixels * 3, red + vec_pixels, green + vec_pixels, blue + vec_pixels,
+											pixels - vec_pixels, scale);
+}
+
+static void rgb48_to_f32_neon(const uint16_t *src, float *dst, size_t pixels, const float *mul)
+{
+	size_t i, vec_pixels = pixels & ~(size_t) 7;
+	uint16x8x3_t rgb;
+	float32x4_t lo[3], hi[3];
+	int c;
+
+	for (i = 0; i < vec_pixels; i += 8) {
+		rgb = vld3q_u16(src + i * 3);
+
+		for (c = 0; c < 3; c++) {
+			cvt_u16_f32(rgb.val[c], &lo[c], &hi[c]);
+		}
+
+		vst1q_f32(dst + i, vaddq_f32(vaddq_f32(vmulq_n_f32(lo[0], mul[0]), vmulq_n_f32(lo[1], mul[1])),
+														vmulq_n_f32(lo[2], mul[2])));
+		vst1q_f32(dst + i + 4, vaddq_f32(vaddq_f32(vmulq_n_f32(hi[0], mul[0]), vmulq_n_f32(hi[1], mul[1])),
+														vmulq_n_f32(hi[2], mul[2])));
+	}
+
+	rgb48_to_f32_scalar(src + vec_pixels * 3, dst + vec_pixels, pixels - vec_pixels, mul);
+}
+
+#endif
+
+/* kernel sets from the slowest to the fastest, auto selection takes the last supported one */
+static const pixel_kernels_t KERNELS[] = {
+	{ "scalar", NULL, rgb48_to_gray_scalar,
+		deinterleave_rgb48_fits_scalar, rgb48_to_gray_fits_scalar,
+		deinterleave_rgb48_f32_scalar, rgb48_to_f32_scalar, u16_to_f32_scalar, u16_to_fits_scalar },
+#if defined(PIXEL_KERNELS_X86)
+	{ "sse2", cpu_has_sse2, rgb48_to_gray_sse2,
+		deinterleave_rgb48_fits_scalar, rgb48_to_gray_fits_sse2,
+		deinterleave_rgb48_f32_scalar, rgb48_to_f32_scalar, u16_to_f32_sse2, u16_to_fits_sse2 },
+	{ "ssse3", cpu_has_ssse3, rgb48_to_gray_ssse3,
+		deinterleave_rgb48_fits_ssse3, rgb48_to_gray_fits_ssse3,
+		deinterleave_rgb48_f32_ssse3, rgb48_to_f32_ssse3, u16_to_f32_sse2, u16_to_fits_sse2 },
+	{ "avx2", cpu_has_avx2, rgb48_to_gray_avx2,
+		deinterleave_rgb48_fits_avx2, rgb48_to_gray_fits_avx2,
+		deinterleave_rgb48_f32_avx2, rgb48_to_f32_avx2, u16_to_f32_avx2, u16_to_fits_avx2 },
+	{ "avx512", cpu_has_avx512, rgb48_to_gray_avx512,
+		deinterleave_rgb48_fits_avx512, rgb48_to_gray_fits_avx512,
+		deinterleave_rgb48_f32_avx512, rgb48_to_f32_avx512, u16_to_f32_avx512, u16_to_fits_avx512 },
+#elif defined(__ARM_NEON)
+	{ "neon", cpu_has_neon, rgb48_to_gray_neon,
+		deinterleave_rgb48_fits_neon, rgb48_to_gray_fits_neon,
+		deinterleave_rgb48_f32_neon, rgb48_to_f32_neon, u16_to_f32_neon, u16_to_fits_neon },
+#endif
+};
+
+#define KERNELS_COUNT (sizeof(KERNELS) / sizeof(KERNELS[0]))
+
+static const pixel_kernels_t *active_kernels = &KERNELS[0];
+
+static int kernels_supported(const pixel_kernels_t *kernels)
+{
+	return !kernels->supported || kernels->supported();
+}
+
+/* called before the converter threads are started, empty name or "auto" selects the best supported set */
+int pixel_kernels_select(const char *name)
+{
+	int i;
+
+#if defined(PIXEL_KERNELS_X86)
+	__builtin_cpu_init();
+#endif
+
+	if (!name || name[0] == '\0' || !strcmp(name, "auto")) {
+		for (i = KERNELS_COUNT - 1; i > 0; i--) {
+			if (kernels_supported(&KERNELS[i])) {
+				break;
+			}
+		}
+
+		active_kernels = &KERNELS[i];
+
+		return 0;
+	}
+
+	for (i = 0; i < KERNELS_COUNT; i++) {
+		if (!strcmp(name, KERNELS[i].name)) {
+			if (!kernels_supported(&KERNELS[i])) {
+				return -1;
+			}
+
+			active_kernels = &KERNELS[i];
+
+			return 0;
+		}
+	}
+
+	return -1;
+}
+
+const char *pixel_kernels_name()
+{
+	return active_kernels->name;
+}
+
+void rgb48_to_gray(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	active_kernels->rgb48_to_gray(src, dst, pixels, gw);
+}
+
+void deinterleave_rgb48_fits(const uint16_t *src, uint16_t *red, uint16_t *green, uint16_t *blue, size_t pixels)
+{
+	active_kernels->deinterleave_rgb48_fits(src, red, green, blue, pixels);
+}
+
+void rgb48_to_gray_fits(const uint16_t *src, uint16_t *dst, size_t pixels, const gray_weights_t *gw)
+{
+	active_kernels->rgb48_to_gray_fits(src, dst, pixels, gw);
+}
+
+void deinterleave_rgb48_f32(const uint16_t *src, float *red, float *green, float *blue, size_t pixels, float scale)
+{
+	active_kernels->deinterleave_rgb48_f32(src, red, green, blue, pixels, scale);
+}
+
+void rgb48_to_f32(const uint16_t *src, float *dst, size_t pixels, const float *mul)
+{
+	active_kernels->rgb48_to_f32(src, dst, pixels, mul);
+}
+
+void u16_to_f32(const uint16_t *src, float *dst, size_t pixels, float scale)
+{
+	active_kernels->u16_to_f32(src, dst, pixels, scale);
+}
+
+void u16_to_fits(const uint16_t *src, uint16_t *dst, size_t pixels)
+{
+	active_kernels->u16_to_fits(src, dst, pixels);
+}
+
+/* 
+   One function per channel: offset of the channel is a constant in the loop,
+   so it has no branches and compiler vectorizes the strided load.
+ */
+#define DEFINE_EXTRACT_RGB48(name, channel) \
+void extract_rgb48_##name##_fits(const uint16_t *src, uint16_t *dst, size_t pixels) \
+{ \
+	size_t i; \
+ \
+	for (i = 0; i < pixels; i++) { \
+		dst[i] = fits_u16(src[i * 3 + channel]); \
+	} \
+}
+
+DEFINE_EXTRACT_RGB48(red, 0)
+DEFINE_EXTRACT_RGB48(green, 1)
+DEFINE_EXTRACT_RGB48(blue, 2)
@@ -18,46 +18,119 @@
    along with this program.  If not, see <http://www.gnu.org/licenses/>.  
  */
 
+#define _GNU_SOURCE
+
 #include <sys/types.h>
+#include <sys/stat.h>
 #include <libraw/libraw.h>
+#include <stdlib.h>
 #include <string.h>
 #include <errno.h>
+#include <fcntl.h>
+#include <unistd.h>
 #include <fitsio.h>
+#include <fitsio2.h>
 #include <time.h>
+#include <pthread.h>
+#include <dlfcn.h>
 #include "file_utils.h"
 #include "raw2fits.h"
+#include "logger.h"
+#include "pixel_kernels.h"
+#include "cfa_kernels.h"
+#include "fits_writer.h"
+#include "thread_pool.h"
 #include "coords_calc.h"
 #include "version.h"
 
-static char *FILENAME_CHANNEL_POSTFIX[6] = {
+static char *FILENAME_CHANNEL_POSTFIX[7] = {
 	"_AVG_GRAY.fits\0",
 	".fits\0",
 	"_RGB.fits\0",
 	"_RED.fits\0",
 	"_GREEN.fits\0",
-	"_BLUE.fits\0"
-};
-
-static FRAME_MODE FRAME_COPY_MODES[3] = {
-	RED_ONLY,
-	GREEN_ONLY,
-	BLUE_ONLY
+	"_BLUE.fits\0",
+	"_CFA.fits\0"
 };
 
-static char *FITS_HEADER_COMMENT[6] = {
+static char *FITS_HEADER_COMMENT[7] = {
 	"Average grayscale",
 	"All channels by files",
 	"All channels in one file",
 	"RED channel",
 	"GREEN channel",
-	"BLUE channel"
+	"BLUE channel",
+	"Raw CFA mosaic, not debayered"
 };
 
+static pthread_key_t decoder_key;
+static pthread_once_t decoder_key_once = PTHREAD_ONCE_INIT;
+
+static void decoder_release(void *rawdata)
+{
+	libraw_close((libraw_data_t *) rawdata);
+}
+
+static void decoder_key_create()
+{
+	pthread_key_create(&decoder_key, &decoder_release);
+}
+
+/* 
+   Every thread keeps own LibRaw handle for the whole batch,
+   handle is recycled between the files and closed when the thread exits.
+ */
+static libraw_data_t *get_thread_decoder()
+{
+	libraw_data_t *rawdata;
+
+	pthread_once(&decoder_key_once, &decoder_key_create);
+
+	rawdata = (libraw_data_t *) pthread_getspecific(decoder_key);
+
+	if (!rawdata) {
+		rawdata = libraw_init(0);
+
+		if (rawdata) {
+			pthread_setspecific(decoder_key, rawdata);
+		}
+	}
+
+	return rawdata;
+}
+
+/* 
+   LibRaw built with OpenMP brings the runtime into the process.
+   Number of threads is set for the calling thread only, so every decoder has own value.
+ */
+typedef void (*omp_set_num_threads_fn)(int num_threads);
+
+static omp_set_num_threads_fn omp_set_threads = NULL;
+static pthread_once_t omp_lookup_once = PTHREAD_ONCE_INIT;
+
+static void omp_lookup()
+{
+	omp_set_threads = (omp_set_num_threads_fn) dlsym(RTLD_DEFAULT, "omp_set_num_threads");
+}
+
+static void set_decoder_threads(converter_params_t *arg, int threads)
+{
+	pthread_once(&omp_lookup_once, &omp_lookup);
+
+	if (!omp_set_threads || threads <= 0) {
+		return;
+	}
+
+	omp_set_threads(threads);
+
+	log_debug(arg, "\tDecoding with %i threads\n", threads);
+}
+
 static int decoder_progress_callback(void *data, enum LibRaw_progress p,int iteration, int expected)
 {
 	converter_params_t *params = (converter_params_t *) data;
 
-	params->logger_msg(params->logger_arg, "\t%s, step %i/%i\n", libraw_strprogress(p), iteration + 1, expected);
+	log_trace(params, "\t%s, step %i/%i\n", libraw_strprogress(p), iteration + 1, expected);
 
 	return !params->converter_run;
 }
@@ -72,7 +145,7 @@ static void print_error(converter_params_t *arg, char *err_where, int err)
 		err_descr = libraw_strerror(err);
 	}
 
-	arg->logger_msg(arg->logger_arg, "%s. %s\n", err_where, err_descr);
+	log_error(arg, "%s. %s\n", err_where, err_descr);
 }
 
 void set_metadata_from_raw(libraw_data_t *rawdata, file_metadata_t *dst_meta)
@@ -111,33 +184,78 @@ void set_metadata_from_raw(libraw_data_t *rawdata, file_metadata_t *dst_meta)
 	}
 }
 
-static int create_new_fits(fitsfile **fptr, char *filename)
+/* 
+   FITS file is written by cfitsio or by the native writer,
+   header cards are described once and both backends make the same bytes.
+ */
+typedef struct fits_output {
+	fitsfile *fptr;
+	fits_writer_t native;
+	int is_native;
+} fits_output_t;
+
+static int create_new_fits(fits_output_t *out, char *filename, fits_backend_t backend)
 {
 	int status = 0;
-	fits_create_file(fptr, filename, &status);
+
+	out->is_native = backend == FITS_BACKEND_NATIVE;
+
+	if (out->is_native) {
+		fits_writer_create(&out->native, filename, &status);
+	} else {
+		fits_create_file(&out->fptr, filename, &status);
+	}
 
 	return status;
 }
 
-void close_fits(fitsfile *fptr)
+void close_fits(fits_output_t *out)
 {
 	int status = 0;
 
-	fits_flush_file(fptr, &status);
-	fits_close_file(fptr, &status);
+	if (out->is_native) {
+		fits_writer_close(&out->native, &status);
+		return;
+	}
+
+	fits_flush_file(out->fptr, &status);
+	fits_close_file(out->fptr, &status);
 }
 
-int create_fits_image(fitsfile *fptr, int width, int height, int bitpixel)
+int create_fits_image(fits_output_t *out, int width, int height, int bitpixel)
 {
 	unsigned int naxis = 2;
 	long naxes[2] = { width, height };
 	int status = 0;
 
-	fits_create_img(fptr, bitpixel, naxis, naxes, &status);
+	if (out->is_native) {
+		fits_writer_create_img(&out->native, bitpixel, width, height, &status);
+	} else {
+		fits_create_img(out->fptr, bitpixel, naxis, naxes, &status);
+	}
 
 	return status;
 }
 
+static void write_key(fits_output_t *out, int datatype, const char *keyname, void *value,
+										const char *comment, int *status)
+{
+	if (out->is_native) {
+		fits_writer_write_key(&out->native, datatype, keyname, value, comment, status);
+	} else {
+		fits_write_key(out->fptr, datatype, keyname, value, comment, status);
+	}
+}
+
+static void write_comment(fits_output_t *out, const char *comment, int *status)
+{
+	if (out->is_native) {
+		fits_writer_write_comment(&out->native, comment, status);
+	} else {
+		fits_write_comment(out->fptr, comment, status);
+	}
+}
+
 void get_current_datetime(char *dst)
 {
 	time_t lt = time(NULL);
@@ -146,136 +264,969 @@ void get_current_datetime(char *dst)
 	strftime(dst, 25, "%Y-%m-%dT%H:%M:%S", utc_tm);
 }
 
-int write_fits_header(fitsfile *fptr, file_metadata_t *meta, char *add_comment)
+/* header cards in the order they are written */
+typedef enum header_card {
+	CARD_CREATOR = 0,
+	CARD_DATE,
+	CARD_OBJECT,
+	CARD_CTYPE1,
+	CARD_CTYPE2,
+	CARD_CRPIX1,
+	CARD_CRPIX2,
+	CARD_CRVAL1,
+	CARD_CRVAL2,
+	CARD_TELESCOP,
+	CARD_TELAPER,
+	CARD_TELFOC,
+	CARD_INSTRUME,
+	CARD_DATE_OBS,
+	CARD_EXPTIME,
+	CARD_FILTER,
+	CARD_OBSERVAT,
+	CARD_SITENAME,
+	CARD_SITELAT,
+	CARD_SITELONG,
+	CARD_SITEELEV,
+	CARD_OBSERVER,
+	CARD_RA,
+	CARD_DEC,
+	CARD_TEMPERAT,
+	CARD_OBSNOTES,
+	HEADER_CARDS
+} header_card_t;
+
+typedef struct fits_header {
+	char cards[HEADER_CARDS][FLEN_CARD];
+	int status;
+} fits_header_t;
+
+/* 
+   Cards which are the same for the whole batch are formatted once.
+   Every file takes a copy and fills the cards which depend on the file.
+ */
+static fits_header_t header_template;
+static fits_backend_t header_backend;
+
+/* cfitsio cards are formatted by cfitsio itself, the same way fits_write_key() does it */
+static void make_key_card(fits_header_t *hdr, header_card_t idx, int datatype, const char *keyname,
+										void *value, const char *comment)
+{
+	char str[FLEN_VALUE];
+
+	if (header_backend == FITS_BACKEND_NATIVE) {
+		fits_writer_make_key(datatype, keyname, value, comment, hdr->cards[idx], &hdr->status);
+		return;
+	}
+
+	switch (datatype) {
+		case TSTRING:
+			ffs2c((char *) value, str, &hdr->status);
+			break;
+
+		case TFLOAT:
+			ffr2e(*(float *) value, -7, str, &hdr->status);
+			break;
+
+		default:
+			hdr->status = BAD_DATATYPE;
+			return;
+	}
+
+	ffmkky(keyname, str, comment, hdr->cards[idx], &hdr->status);
+}
+
+void raw2fits_batch_init(converter_params_t *arg)
 {
-	int status = 0;
-	char time_now[25];
-	float cpix1 = (meta->width + 1) / 2;
-	float cpix2 = (meta->height + 1) / 2;
+	fits_header_t *hdr = &header_template;
+	file_metadata_t *meta = &arg->meta;
 	char coord_buf[15];
 	char ver_str[21];
 
 	float ra = (float) coordinates_to_deg(meta->ra.hour, meta->ra.min, meta->ra.sec, meta->ra.msec, 1);
 	float dec = (float) coordinates_to_deg(meta->dec.hour, meta->dec.min, meta->dec.sec, meta->dec.msec, 0);
 
+	memset(hdr, 0, sizeof(fits_header_t));
+	header_backend = arg->fits_backend;
+
 	snprintf(ver_str, 21, "raw2fits %i.%i.%i"
 			, RAW2FITS_VERSION_MAJOR, RAW2FITS_VERSION_MINOR, RAW2FITS_VERSION_PATCH);
 
-	get_current_datetime(time_now);
-
-	fits_write_key(fptr, TSTRING, "CREATOR", ver_str, "", &status);
-	fits_write_key(fptr, TSTRING, "DATE", time_now, "Fits creation date, UTC", &status);
-	fits_write_key(fptr, TSTRING, "OBJECT", meta->object, "Name of the object observed", &status);
-	fits_write_key(fptr, TSTRING, "CTYPE1", "RA---TAN", "RA in tangent plane projection", &status);
-	fits_write_key(fptr, TSTRING, "CTYPE2", "DEC--TAN", "DEC in tangent plane projection", &status);
-	fits_write_key(fptr, TFLOAT, "CRPIX1", &cpix1, "The reference pixel coordinate 1", &status);
-	fits_write_key(fptr, TFLOAT, "CRPIX2", &cpix2, "The reference pixel coordinate 2", &status);
-	fits_write_key(fptr, TFLOAT, "CRVAL1", &ra, "Reference pixel value in degrees", &status);
-	fits_write_key(fptr, TFLOAT, "CRVAL2", &dec, "Reference pixel value in degrees", &status);
+	make_key_card(hdr, CARD_CREATOR, TSTRING, "CREATOR", ver_str, "");
+	make_key_card(hdr, CARD_OBJECT, TSTRING, "OBJECT", meta->object, "Name of the object observed");
+	make_key_card(hdr, CARD_CTYPE1, TSTRING, "CTYPE1", "RA---TAN", "RA in tangent plane projection");
+	make_key_card(hdr, CARD_CTYPE2, TSTRING, "CTYPE2", "DEC--TAN", "DEC in tangent plane projection");
+	make_key_card(hdr, CARD_CRVAL1, TFLOAT, "CRVAL1", &ra, "Reference pixel value in degrees");
+	make_key_card(hdr, CARD_CRVAL2, TFLOAT, "CRVAL2", &dec, "Reference pixel value in degrees");
 
 // TODO: calculate and store CDELTx
-//	fits_write_key(fptr, TFLOAT, "CDELT1", &pixel, "Coordinate increment per pixel in DEGREES/PIXEL", &status);
-//	fits_write_key(fptr, TFLOAT, "CDELT2", &pixel, "Coordinate increment per pixel in DEGREES/PIXEL", &status);
-
-	fits_write_key(fptr, TSTRING, "TELESCOP", meta->telescope, "Telescope", &status);
-	fits_write_key(fptr, TFLOAT, "TELAPER", &meta->teleaper, "Clear aperture of the telescope [m]", &status);
-	fits_write_key(fptr, TFLOAT, "TELFOC", &meta->telefoc, "Focal length of the telescope [m]", &status);
-	fits_write_key(fptr, TSTRING, "INSTRUME", meta->instrument, "Detector type", &status);
-	fits_write_key(fptr, TSTRING, "DATE-OBS", meta->date, "Observation date and time, UTC", &status);
-	fits_write_key(fptr, TFLOAT, "EXPTIME", &meta->exptime, "Exposure time in seconds", &status);
-	fits_write_key(fptr, TSTRING, "FILTER", meta->filter, "Filter used when taking image", &status);
-	fits_write_key(fptr, TSTRING, "OBSERVAT", meta->observatory, "Observatory name", &status);
-	fits_write_key(fptr, TSTRING, "SITENAME", meta->sitename, "Observatory site name", &status);
-	fits_write_key(fptr, TFLOAT, "SITELAT", &meta->sitelat, "Latitude of the observing site, decimal degrees", &status);
-	fits_write_key(fptr, TFLOAT, "SITELONG", &meta->sitelon, "East longitude of the observing site, decimal degrees", &status);
-	fits_write_key(fptr, TFLOAT, "SITEELEV", &meta->sitelev, "Elevation of the observatory site [m].", &status);
-	fits_write_key(fptr, TSTRING, "OBSERVER", meta->observer, "", &status);
+//	make_key_card(hdr, CARD_CDELT1, TFLOAT, "CDELT1", &pixel, "Coordinate increment per pixel in DEGREES/PIXEL");
+//	make_key_card(hdr, CARD_CDELT2, TFLOAT, "CDELT2", &pixel, "Coordinate increment per pixel in DEGREES/PIXEL");
+
+	make_key_card(hdr, CARD_TELESCOP, TSTRING, "TELESCOP", meta->telescope, "Telescope");
+	make_key_card(hdr, CARD_TELAPER, TFLOAT, "TELAPER", &meta->teleaper, "Clear aperture of the telescope [m]");
+	make_key_card(hdr, CARD_TELFOC, TFLOAT, "TELFOC", &meta->telefoc, "Focal length of the telescope [m]");
+	make_key_card(hdr, CARD_FILTER, TSTRING, "FILTER", meta->filter, "Filter used when taking image");
+	make_key_card(hdr, CARD_OBSERVAT, TSTRING, "OBSERVAT", meta->observatory, "Observatory name");
+	make_key_card(hdr, CARD_SITENAME, TSTRING, "SITENAME", meta->sitename, "Observatory site name");
+	make_key_card(hdr, CARD_SITELAT, TFLOAT, "SITELAT", &meta->sitelat, "Latitude of the observing site, decimal degrees");
+	make_key_card(hdr, CARD_SITELONG, TFLOAT, "SITELONG", &meta->sitelon, "East longitude of the observing site, decimal degrees");
+	make_key_card(hdr, CARD_SITEELEV, TFLOAT, "SITEELEV", &meta->sitelev, "Elevation of the observatory site [m].");
 
 	coordinates_to_sexigesimal_str(meta->ra.hour, meta->ra.min, meta->ra.sec, meta->ra.msec, coord_buf);
-	fits_write_key(fptr, TSTRING, "RA", coord_buf, "Object Right Ascension", &status);
+	make_key_card(hdr, CARD_RA, TSTRING, "RA", coord_buf, "Object Right Ascension");
 
 	coordinates_to_sexigesimal_str(meta->dec.hour, meta->dec.min, meta->dec.sec, meta->dec.msec, coord_buf);
-	fits_write_key(fptr, TSTRING, "DEC", coord_buf, "Object Declination", &status);
+	make_key_card(hdr, CARD_DEC, TSTRING, "DEC", coord_buf, "Object Declination");
+
+	make_key_card(hdr, CARD_TEMPERAT, TFLOAT, "TEMPERAT", &meta->temperature, "Camera temperature in C");
+	make_key_card(hdr, CARD_OBSNOTES, TSTRING, "OBSNOTES", meta->note, "");
+}
+
+/* metadata from the raw file and the frame size go to the copy of the batch cards */
+static void make_file_header(fits_header_t *hdr, file_metadata_t *meta)
+{
+	char time_now[25];
+	float cpix1 = (meta->width + 1) / 2;
+	float cpix2 = (meta->height + 1) / 2;
 
-	fits_write_key(fptr, TFLOAT, "TEMPERAT", &meta->temperature, "Camera temperature in C", &status);
-	fits_write_key(fptr, TSTRING, "OBSNOTES", meta->note, "", &status);
+	memcpy(hdr, &header_template, sizeof(fits_header_t));
 
-	fits_write_comment(fptr, add_comment, &status);
+	get_current_datetime(time_now);
+
+	make_key_card(hdr, CARD_DATE, TSTRING, "DATE", time_now, "Fits creation date, UTC");
+	make_key_card(hdr, CARD_CRPIX1, TFLOAT, "CRPIX1", &cpix1, "The reference pixel coordinate 1");
+	make_key_card(hdr, CARD_CRPIX2, TFLOAT, "CRPIX2", &cpix2, "The reference pixel coordinate 2");
+	make_key_card(hdr, CARD_INSTRUME, TSTRING, "INSTRUME", meta->instrument, "Detector type");
+	make_key_card(hdr, CARD_DATE_OBS, TSTRING, "DATE-OBS", meta->date, "Observation date and time, UTC");
+	make_key_card(hdr, CARD_EXPTIME, TFLOAT, "EXPTIME", &meta->exptime, "Exposure time in seconds");
+	make_key_card(hdr, CARD_OBSERVER, TSTRING, "OBSERVER", meta->observer, "");
+}
+
+int write_fits_header(fits_output_t *out, fits_header_t *hdr, char *add_comment)
+{
+	int status = hdr->status;
+	int i;
+
+	for (i = 0; i < HEADER_CARDS; i++) {
+		if (out->is_native) {
+			fits_writer_write_record(&out->native, hdr->cards[i], &status);
+		} else {
+			fits_write_record(out->fptr, hdr->cards[i], &status);
+		}
+	}
+
+	write_comment(out, add_comment, &status);
 
 	return status;
 }
 
-void copy_image_buf(FRAME_MODE mode, libraw_processed_image_t *proc_img, uint16_t **dst)
+/* unsigned 16-bit frames are written as BITPIX = 16 with BZERO = 32768 */
+static int get_output_bits(int bitpix)
 {
-	int i, k = 0;
-	uint16_t rgb[3];
-	uint16_t *image = (ushort *)proc_img->data;
+	return bitpix == FLOAT_IMG ? FLOAT_IMG : USHORT_IMG;
+}
 
-	for (i = 0; i < proc_img->width * proc_img->height; i++) {
-		rgb[0] = (ushort)image[k];
-		rgb[1] = (ushort)image[k + 1];
-		rgb[2] = (ushort)image[k + 2];
+static size_t get_sample_size(int bits)
+{
+	return bits == FLOAT_IMG ? sizeof(float) : sizeof(uint16_t);
+}
 
-		switch (mode) {
-			case GRAYSCALE:
-				(*dst)[i] = (rgb[0] + rgb[1] + rgb[2]) / 3;
-				break;
+/* frame is converted by the bands of rows, idle decoders take some of them */
+#define FRAME_BAND_ROWS 64
 
-			case RED_ONLY:
-				(*dst)[i] = rgb[0];
-				break;
+/* pixels of the LibRaw image gathered at once into the interleaved RGB for the copy function */
+#define FRAME_CHUNK_PIXELS 1024
 
-			case GREEN_ONLY:
-				(*dst)[i] = rgb[1];
-				break;
+/* 
+   planes have the type of the output, float values are multiplied by scale in the same pass,
+   16-bit values are stored in the FITS order and written without conversion
+ */
+typedef struct frame_copy_arg frame_copy_arg_t;
+typedef void (*frame_copy_fn)(const frame_copy_arg_t *fc, const uint16_t *image, void **planes, size_t pixels);
 
-			case BLUE_ONLY:
-				(*dst)[i] = rgb[2];
-				break;
+/* 
+   Source is either interleaved RGB made by libraw_dcraw_make_mem_image()
+   or 4-channel LibRaw image which is read directly, flip is applied while reading it.
+ */
+struct frame_copy_arg {
+	frame_copy_fn copy;
+	const uint16_t *image;
+	const uint16_t (*raw_image)[4];
+	int flip;
+	size_t raw_width;
+	size_t raw_height;
+	void **planes;
+	int planes_count;
+	size_t sample_size;
+	float scale;
+	gray_weights_t gray;
+	size_t width;
+	size_t height;
+};
+
+static void copy_grayscale(const frame_copy_arg_t *fc, const uint16_t *image, void **planes, size_t pixels)
+{
+	rgb48_to_gray_fits(image, (uint16_t *) planes[0], pixels, &fc->gray);
+}
+
+/* all three channels are split in one pass over the image */
+static void copy_all_channels(const frame_copy_arg_t *fc, const uint16_t *image, void **planes, size_t pixels)
+{
+	deinterleave_rgb48_fits(image, (uint16_t *) planes[0], (uint16_t *) planes[1], (uint16_t *) planes[2], pixels);
+}
+
+static void copy_red(const frame_copy_arg_t *fc, const uint16_t *image, void **planes, size_t pixels)
+{
+	extract_rgb48_red_fits(image, (uint16_t *) planes[0], pixels);
+}
+
+static void copy_green(const frame_copy_arg_t *fc, const uint16_t *image, void **planes, size_t pixels)
+{
+	extract_rgb48_green_fits(image, (uint16_t *) planes[0], pixels);
+}
+
+static void copy_blue(const frame_copy_arg_t *fc, const uint16_t *image, void **planes, size_t pixels)
+{
+	extract_rgb48_blue_fits(image, (uint16_t *) planes[0], pixels);
+}
 
-			default:
-				break;
+/* same rounded down mean as the 16-bit output, float gray is always the 16-bit one multiplied by scale */
+static void copy_grayscale_f32(const frame_copy_arg_t *fc, const uint16_t *image, void **planes, size_t pixels)
+{
+	uint16_t gray[FRAME_CHUNK_PIXELS];
+	float *dst = (float *) planes[0];
+	size_t i, count;
+
+	for (i = 0; i < pixels; i += count) {
+		count = pixels - i < FRAME_CHUNK_PIXELS ? pixels - i : FRAME_CHUNK_PIXELS;
+
+		rgb48_to_gray(image + i * 3, gray, count, &fc->gray);
+		u16_to_f32(gray, dst + i, count, fc->scale);
+	}
+}
+
+static void copy_all_channels_f32(const frame_copy_arg_t *fc, const uint16_t *image, void **planes, size_t pixels)
+{
+	deinterleave_rgb48_f32(image, (float *) planes[0], (float *) planes[1], (float *) planes[2], pixels, fc->scale);
+}
+
+static void copy_red_f32(const frame_copy_arg_t *fc, const uint16_t *image, void **planes, size_t pixels)
+{
+	const float mul[3] = { fc->scale, 0, 0 };
+
+	rgb48_to_f32(image, (float *) planes[0], pixels, mul);
+}
+
+static void copy_green_f32(const frame_copy_arg_t *fc, const uint16_t *image, void **planes, size_t pixels)
+{
+	const float mul[3] = { 0, fc->scale, 0 };
+
+	rgb48_to_f32(image, (float *) planes[0], pixels, mul);
+}
+
+static void copy_blue_f32(const frame_copy_arg_t *fc, const uint16_t *image, void **planes, size_t pixels)
+{
+	const float mul[3] = { 0, 0, fc->scale };
+
+	rgb48_to_f32(image, (float *) planes[0], pixels, mul);
+}
+
+/* indexed by the float output flag and FRAME_MODE, conversion is selected once per frame, CFA is not processed */
+static frame_copy_fn FRAME_COPY[2][7] = {
+	{
+		copy_grayscale,
+		copy_all_channels,
+		copy_all_channels,
+		copy_red,
+		copy_green,
+		copy_blue,
+		NULL
+	},
+	{
+		copy_grayscale_f32,
+		copy_all_channels_f32,
+		copy_all_channels_f32,
+		copy_red_f32,
+		copy_green_f32,
+		copy_blue_f32,
+		NULL
+	}
+};
+
+/* index of the output pixel in the LibRaw image, same as flip_index() in LibRaw */
+static ptrdiff_t flip_index(frame_copy_arg_t *fc, size_t row, size_t col)
+{
+	size_t tmp;
+
+	if (fc->flip & 4) {
+		tmp = row;
+		row = col;
+		col = tmp;
+	}
+
+	if (fc->flip & 2) {
+		row = fc->raw_height - 1 - row;
+	}
+
+	if (fc->flip & 1) {
+		col = fc->raw_width - 1 - col;
+	}
+
+	return (ptrdiff_t) (row * fc->raw_width + col);
+}
+
+static void copy_raw_image_rows(frame_copy_arg_t *fc, size_t first_row, size_t rows)
+{
+	uint16_t chunk[FRAME_CHUNK_PIXELS * 3];
+	void *planes[3];
+	const uint16_t *px;
+	ptrdiff_t src, step = flip_index(fc, 0, 1) - flip_index(fc, 0, 0);
+	size_t row, col, count, offset, i;
+	int p;
+
+	for (row = first_row; row < first_row + rows; row++) {
+		src = flip_index(fc, row, 0);
+
+		for (col = 0; col < fc->width; col += count) {
+			count = fc->width - col < FRAME_CHUNK_PIXELS ? fc->width - col : FRAME_CHUNK_PIXELS;
+
+			for (i = 0; i < count; i++) {
+				px = fc->raw_image[src];
+
+				chunk[i * 3] = px[0];
+				chunk[i * 3 + 1] = px[1];
+				chunk[i * 3 + 2] = px[2];
+
+				src += step;
+			}
+
+			offset = row * fc->width + col;
+
+			for (p = 0; p < fc->planes_count; p++) {
+				planes[p] = (char *) fc->planes[p] + offset * fc->sample_size;
+			}
+
+			fc->copy(fc, chunk, planes, count);
 		}
+	}
+}
+
+static void copy_frame_band(void *arg, size_t band)
+{
+	frame_copy_arg_t *fc = (frame_copy_arg_t *) arg;
+	size_t first_row = band * FRAME_BAND_ROWS;
+	size_t rows = fc->height - first_row < FRAME_BAND_ROWS ? fc->height - first_row : FRAME_BAND_ROWS;
+	size_t offset = first_row * fc->width;
+	void *planes[3];
+	int i;
+
+	if (fc->raw_image) {
+		copy_raw_image_rows(fc, first_row, rows);
+		return;
+	}
 
-		k += 3;
+	for (i = 0; i < fc->planes_count; i++) {
+		planes[i] = (char *) fc->planes[i] + offset * fc->sample_size;
 	}
+
+	fc->copy(fc, fc->image + offset * 3, planes, rows * fc->width);
+}
+
+/* 
+   libraw_dcraw_make_mem_image() makes another copy of the image through the gamma curve.
+   With linear gamma, no auto bright and bright = 1 the curve is identity,
+   so the image is read directly and the copy is not needed.
+ */
+static int can_read_raw_image(libraw_data_t *rawdata)
+{
+#if (LIBRAW_COMPILE_CHECK_VERSION_NOTLESS(0,17))
+	return rawdata->image && rawdata->idata.colors == 3
+		&& rawdata->params.output_bps == 16 && rawdata->params.no_auto_bright && rawdata->params.bright == 1.0f
+		&& rawdata->params.gamm[0] == 1.0 && rawdata->params.gamm[1] == 1.0
+		&& rawdata->sizes.iwidth == rawdata->sizes.width && rawdata->sizes.iheight == rawdata->sizes.height;
+#else
+	return 0;
+#endif
 }
 
-int write_fits_image(fitsfile *fptr, uint16_t *frame, int width, int height)
+static int write_bayer_keys(fits_output_t *out, char *pattern)
+{
+	int status = 0;
+	int offset = 0;
+
+	write_key(out, TSTRING, "BAYERPAT", pattern, "Bayer color pattern", &status);
+	write_key(out, TINT, "XBAYROFF", &offset, "X offset of Bayer array", &status);
+	write_key(out, TINT, "YBAYROFF", &offset, "Y offset of Bayer array", &status);
+
+	return status;
+}
+
+static int write_binning_keys(fits_output_t *out, int binning)
+{
+	int status = 0;
+
+	write_key(out, TINT, "XBINNING", &binning, "Binning factor in width", &status);
+	write_key(out, TINT, "YBINNING", &binning, "Binning factor in height", &status);
+
+	return status;
+}
+
+/* 
+   16-bit frames are already big-endian with BZERO applied, the bytes go to the data unit as is.
+   Big writes are done by cfitsio directly from the frame, without the conversion buffer.
+   Native writer swaps float frames in place, frame is not used after the write.
+ */
+int write_fits_image(fits_output_t *out, void *frame, int width, int height, int bits)
 {
 	int status = 0;
 	long fpx[2] = { 1L, 1L };
+	LONGLONG headstart, datastart, dataend;
 
-	fits_write_pix(fptr, TUSHORT, fpx, width * height, frame, &status);
+	if (out->is_native) {
+		return fits_writer_write_image(&out->native, frame, width, height, bits, &status);
+	}
+
+	if (bits == FLOAT_IMG) {
+		fits_write_pix(out->fptr, TFLOAT, fpx, (LONGLONG) width * height, frame, &status);
+		return status;
+	}
+
+	fits_set_hdustruc(out->fptr, &status);
+	fits_get_hduaddrll(out->fptr, &headstart, &datastart, &dataend, &status);
+
+	if (status == 0) {
+		ffmbyt(out->fptr, datastart, IGNORE_EOF, &status);
+		ffpbyt(out->fptr, (LONGLONG) width * height * sizeof(uint16_t), frame, &status);
+	}
 
 	return status;
 }
 
-void raw2fits(char *file, converter_params_t *arg)
+static int check_target_file(converter_params_t *arg, char *target_filename)
+{
+	if (!is_file_exist(target_filename)) {
+		return 0;
+	}
+
+	if (!arg->fsetup.overwrite) {
+		log_info(arg, "File %s is already exists, skipping...\n", target_filename);
+		return -1;
+	}
+
+	if (remove_file(target_filename) < 0) {
+		log_error(arg, "Unable to remove old file %s, error: %s\n", target_filename, strerror(errno));
+		return -1;
+	}
+
+	return 0;
+}
+
+/* every file starts with own copy of the user's metadata */
+void raw2fits_job_init(raw2fits_job_t *job, converter_params_t *params, char *file)
+{
+	memset(job, 0, sizeof(raw2fits_job_t));
+
+	job->params = params;
+	job->file = file;
+
+	memcpy(&job->meta, &params->meta, sizeof(file_metadata_t));
+}
+
+/* stage 1: load the whole RAW file into memory */
+int raw2fits_read(raw2fits_job_t *job)
+{
+	int fd;
+	struct stat st;
+	ssize_t rd;
+	size_t done = 0;
+	converter_params_t *arg = job->params;
+
+	fd = open(job->file, O_RDONLY);
+
+	if (fd < 0) {
+		print_error(arg, "Failed to open RAW file", errno);
+		return -1;
+	}
+
+	if (fstat(fd, &st) < 0 || st.st_size == 0) {
+		print_error(arg, "Failed to read RAW file", errno ? errno : EINVAL);
+		close(fd);
+		return -1;
+	}
+
+	posix_fadvise(fd, 0, 0, POSIX_FADV_SEQUENTIAL);
+
+	job->rawbuf_size = st.st_size;
+	job->rawbuf = malloc(job->rawbuf_size);
+
+	if (!job->rawbuf) {
+		print_error(arg, "Failed to allocate memory for RAW file", ENOMEM);
+		close(fd);
+		return -1;
+	}
+
+	while (done < job->rawbuf_size) {
+		rd = read(fd, (char *) job->rawbuf + done, job->rawbuf_size - done);
+
+		if (rd < 0 && errno == EINTR) {
+			continue;
+		}
+
+		if (rd <= 0) {
+			print_error(arg, "Failed to read RAW file", rd < 0 ? errno : EIO);
+			close(fd);
+			free(job->rawbuf);
+			job->rawbuf = NULL;
+			return -1;
+		}
+
+		done += rd;
+	}
+
+	close(fd);
+
+	return 0;
+}
+
+/* only 2x2 mosaics are supported */
+static int is_bayer_mosaic(libraw_data_t *rawdata)
+{
+	int row, col;
+
+	/* small filters values are X-Trans and Leaf layouts */
+	if (!rawdata->rawdata.raw_image || rawdata->idata.filters < 1000 || rawdata->idata.colors != 3) {
+		return 0;
+	}
+
+	for (row = 2; row < 16; row++) {
+		for (col = 0; col < 2; col++) {
+			if (libraw_COLOR(rawdata, row, col) != libraw_COLOR(rawdata, row & 1, col)) {
+				return 0;
+			}
+		}
+	}
+
+	return 1;
+}
+
+/* 
+   Bayer pattern from the first stored pixel. Rows are stored bottom-up like in the other modes,
+   so the pattern starts from the last visible row.
+ */
+static int get_bayer_pattern(libraw_data_t *rawdata, char *pattern)
+{
+	int row, col;
+	int last_row = rawdata->sizes.height - 1;
+
+	if (!is_bayer_mosaic(rawdata)) {
+		return -1;
+	}
+
+	for (row = 0; row < 2; row++) {
+		for (col = 0; col < 2; col++) {
+			pattern[row * 2 + col] = rawdata->idata.cdesc[libraw_COLOR(rawdata, last_row - row, col)];
+		}
+	}
+
+	pattern[4] = '\0';
+
+	return 0;
+}
+
+/* 
+   Float output is divided by the white level or by the exposure time when it's requested,
+   16-bit output is never scaled.
+ */
+static float get_output_scale(raw2fits_job_t *job, float white_level)
+{
+	switch (job->params->imsetup.normalize) {
+		case NORMALIZE_RANGE:
+			return 1.0f / white_level;
+
+		case NORMALIZE_EXPTIME:
+			return job->meta.exptime > 0 ? 1.0f / job->meta.exptime : 1.0f;
+
+		default:
+			return 1.0f;
+	}
+}
+
+/* white level of the raw values, LibRaw leaves it zero for some formats */
+static float get_raw_white_level(libraw_data_t *rawdata)
+{
+	return rawdata->color.maximum ? (float) rawdata->color.maximum : (float) UINT16_MAX;
+}
+
+static int get_frame_planes(raw2fits_job_t *job)
+{
+	int i;
+
+	for (i = 0; i < job->planes_count; i++) {
+		job->frames[i] = frame_pool_get((size_t) job->width * job->height * get_sample_size(job->bits));
+
+		if (!job->frames[i]) {
+			log_error(job->params, "Failed to allocate memory for the frame, err: %s\n", strerror(errno));
+			return -1;
+		}
+
+		job->planes[i] = job->frames[i]->data;
+	}
+
+	return 0;
+}
+
+/* RAW_CFA: visible area of the sensor mosaic as is, dcraw_process is not called */
+static int decode_cfa(raw2fits_job_t *job, libraw_data_t *rawdata)
+{
+	converter_params_t *arg = job->params;
+	size_t row, width, height, pitch;
+	const uint16_t *src;
+	float scale;
+
+	if (get_bayer_pattern(rawdata, job->bayer_pattern) < 0) {
+		log_error(arg, "File %s has no Bayer mosaic, unable to store CFA\n", job->file);
+		libraw_recycle(rawdata);
+		return -1;
+	}
+
+	width = rawdata->sizes.width;
+	height = rawdata->sizes.height;
+	pitch = rawdata->sizes.raw_pitch / sizeof(uint16_t);
+
+	job->width = width;
+	job->height = height;
+	job->bits = get_output_bits(arg->imsetup.bitpix);
+	job->planes_count = 1;
+
+	job->meta.bitpixel = job->bits;
+	job->meta.width = job->width;
+	job->meta.height = job->height;
+
+	if (get_frame_planes(job) < 0) {
+		libraw_recycle(rawdata);
+		return -1;
+	}
+
+	scale = get_output_scale(job, get_raw_white_level(rawdata));
+
+	/* rows are stored bottom-up, same as the debayered frames */
+	for (row = 0; row < height; row++) {
+		src = rawdata->rawdata.raw_image + (rawdata->sizes.top_margin + height - 1 - row) * pitch
+											+ rawdata->sizes.left_margin;
+
+		if (job->bits == FLOAT_IMG) {
+			u16_to_f32(src, (float *) job->planes[0] + row * width, width, scale);
+		} else {
+			u16_to_fits(src, (uint16_t *) job->planes[0] + row * width, width);
+		}
+	}
+
+	log_debug(arg, "\tRaw mosaic copied, size = %ix%i, pattern = %s\n", job->width, job->height, job->bayer_pattern);
+
+	libraw_recycle(rawdata);
+
+	/* RAW data is not needed anymore, don't keep it in the writer queue */
+	free(job->rawbuf);
+	job->rawbuf = NULL;
+
+	return 0;
+}
+
+/* visible area of the mosaic with the colour of every site as 0 - red, 1 - green, 2 - blue */
+static int get_cfa_image(libraw_data_t *rawdata, cfa_image_t *cfa)
+{
+	int row, col;
+	char color;
+
+	if (!is_bayer_mosaic(rawdata)) {
+		return -1;
+	}
+
+	cfa->pitch = rawdata->sizes.raw_pitch / sizeof(uint16_t);
+	cfa->data = rawdata->rawdata.raw_image + rawdata->sizes.top_margin * cfa->pitch + rawdata->sizes.left_margin;
+	cfa->width = rawdata->sizes.width;
+	cfa->height = rawdata->sizes.height;
+
+	for (row = 0; row < 2; row++) {
+		for (col = 0; col < 2; col++) {
+			color = rawdata->idata.cdesc[libraw_COLOR(rawdata, row, col)];
+			cfa->color[row][col] = color == 'R' ? 0 : (color == 'B' ? 2 : 1);
+		}
+	}
+
+	return 0;
+}
+
+/* 
+   Mosaic kernels make 16-bit rows, every row is converted to the output while it's still in L1.
+   16-bit rows are made in the frame and converted in place, float rows are made into a small buffer.
+ */
+typedef void (*mosaic_rows_fn)(void *arg, uint16_t **planes, size_t first_row, size_t rows);
+
+typedef struct mosaic_band_arg {
+	mosaic_rows_fn make_rows;
+	void *arg;
+	void **planes;
+	int planes_count;
+	size_t width;
+	size_t height;
+	float scale;
+	int is_float;
+	int failed;
+} mosaic_band_arg_t;
+
+static void mosaic_frame_band(void *arg, size_t band)
+{
+	mosaic_band_arg_t *mb = (mosaic_band_arg_t *) arg;
+	size_t first_row = band * FRAME_BAND_ROWS;
+	size_t rows = mb->height - first_row < FRAME_BAND_ROWS ? mb->height - first_row : FRAME_BAND_ROWS;
+	uint16_t *planes[3];
+	uint16_t *row_buf;
+	size_t row;
+	int i;
+
+	if (!mb->is_float) {
+		for (row = first_row; row < first_row + rows; row++) {
+			for (i = 0; i < mb->planes_count; i++) {
+				planes[i] = (uint16_t *) mb->planes[i] + row * mb->width;
+			}
+
+			mb->make_rows(mb->arg, planes, row, 1);
+
+			for (i = 0; i < mb->planes_count; i++) {
+				u16_to_fits(planes[i], planes[i], mb->width);
+			}
+		}
+
+		return;
+	}
+
+	row_buf = malloc(mb->width * mb->planes_count * sizeof(uint16_t));
+
+	if (!row_buf) {
+		__atomic_store_n(&mb->failed, 1, __ATOMIC_RELAXED);
+		return;
+	}
+
+	for (i = 0; i < mb->planes_count; i++) {
+		planes[i] = row_buf + i * mb->width;
+	}
+
+	for (row = first_row; row < first_row + rows; row++) {
+		mb->make_rows(mb->arg, planes, row, 1);
+
+		for (i = 0; i < mb->planes_count; i++) {
+			u16_to_f32(planes[i], (float *) mb->planes[i] + row * mb->width, mb->width, mb->scale);
+		}
+	}
+
+	free(row_buf);
+}
+
+/* frame is made by the bands in parallel, raw data is released when it's done */
+static int make_mosaic_frame(raw2fits_job_t *job, libraw_data_t *rawdata,
+								mosaic_rows_fn make_rows, void *arg, float white_level)
+{
+	mosaic_band_arg_t band_arg;
+
+	if (get_frame_planes(job) < 0) {
+		libraw_recycle(rawdata);
+		return -1;
+	}
+
+	band_arg.make_rows = make_rows;
+	band_arg.arg = arg;
+	band_arg.planes = job->planes;
+	band_arg.planes_count = job->planes_count;
+	band_arg.width = job->width;
+	band_arg.height = job->height;
+	band_arg.scale = get_output_scale(job, white_level);
+	band_arg.is_float = job->bits == FLOAT_IMG;
+	band_arg.failed = 0;
+
+	thread_pool_parallel_for(&mosaic_frame_band, &band_arg, (band_arg.height + FRAME_BAND_ROWS - 1) / FRAME_BAND_ROWS);
+
+	libraw_recycle(rawdata);
+
+	/* RAW data is not needed anymore, don't keep it in the writer queue */
+	free(job->rawbuf);
+	job->rawbuf = NULL;
+
+	if (band_arg.failed) {
+		log_error(job->params, "Failed to allocate memory for the frame conversion, err: %s\n", strerror(ENOMEM));
+		return -1;
+	}
+
+	return 0;
+}
+
+typedef struct cfa_bin_arg {
+	cfa_image_t cfa;
+	int bin;
+	int sum;
+	int mono;
+	int channel;	/* single channel of the RGB superpixel, -1 for all of them */
+} cfa_bin_arg_t;
+
+static void bin_rows(void *arg, uint16_t **planes, size_t first_row, size_t rows)
+{
+	cfa_bin_arg_t *cb = (cfa_bin_arg_t *) arg;
+	uint16_t *rgb[3] = { NULL, NULL, NULL };
+
+	if (cb->mono) {
+		cfa_bin_mono(&cb->cfa, cb->bin, cb->sum, planes[0], first_row, rows);
+		return;
+	}
+
+	if (cb->channel < 0) {
+		memcpy(rgb, planes, sizeof(rgb));
+	} else {
+		/* single channel, the other ones are not stored */
+		rgb[cb->channel] = planes[0];
+	}
+
+	cfa_bin_rgb(&cb->cfa, cb->bin, cb->sum, rgb, first_row, rows);
+}
+
+/* 
+   Binned frames are made straight from the mosaic in one pass, dcraw_process is not called.
+   Grayscale gives the mono blocks, other modes give the RGB superpixels.
+ */
+static int decode_binned(raw2fits_job_t *job, libraw_data_t *rawdata, int bin, int sum)
+{
+	converter_params_t *arg = job->params;
+	FRAME_MODE mode = arg->imsetup.mode;
+	cfa_bin_arg_t bin_arg;
+	float white_level;
+
+	if (get_cfa_image(rawdata, &bin_arg.cfa) < 0) {
+		log_error(arg, "File %s has no Bayer mosaic, unable to bin it\n", job->file);
+		libraw_recycle(rawdata);
+		return -1;
+	}
+
+	bin_arg.bin = bin;
+	bin_arg.sum = sum;
+	bin_arg.mono = mode == GRAYSCALE;
+	bin_arg.channel = (mode >= RED_ONLY && mode <= BLUE_ONLY) ? (int) (mode - RED_ONLY) : -1;
+
+	job->binning = bin;
+	job->width = bin_arg.cfa.width / bin;
+	job->height = bin_arg.cfa.height / bin;
+	job->bits = get_output_bits(arg->imsetup.bitpix);
+	job->planes_count = (mode == ALL_CHANNELS || mode == ALL_CHANNELS_BY_FILES) ? 3 : 1;
+
+	job->meta.bitpixel = job->bits;
+	job->meta.width = job->width;
+	job->meta.height = job->height;
+
+	/* sums are clipped to 16 bits by the kernel */
+	white_level = get_raw_white_level(rawdata) * (sum ? bin * bin : 1);
+
+	if (white_level > UINT16_MAX) {
+		white_level = UINT16_MAX;
+	}
+
+	if (make_mosaic_frame(job, rawdata, &bin_rows, &bin_arg, white_level) < 0) {
+		return -1;
+	}
+
+	log_debug(arg, "\tRaw mosaic binned %ix%i, size = %ix%i\n", bin, bin, job->width, job->height);
+
+	return 0;
+}
+
+typedef struct cfa_interpolate_arg {
+	cfa_image_t cfa;
+	int channels[3];
+	int planes_count;
+} cfa_interpolate_arg_t;
+
+static void interpolate_rows(void *arg, uint16_t **planes, size_t first_row, size_t rows)
+{
+	cfa_interpolate_arg_t *ci = (cfa_interpolate_arg_t *) arg;
+	int i;
+
+	for (i = 0; i < ci->planes_count; i++) {
+		cfa_interpolate(&ci->cfa, ci->channels[i], planes[i], first_row, rows);
+	}
+}
+
+/* full resolution channels interpolated straight from the mosaic, dcraw_process is not called */
+static int decode_interpolated(raw2fits_job_t *job, libraw_data_t *rawdata)
+{
+	converter_params_t *arg = job->params;
+	FRAME_MODE mode = arg->imsetup.mode;
+	cfa_interpolate_arg_t interp_arg;
+	int i;
+
+	get_cfa_image(rawdata, &interp_arg.cfa);
+
+	job->width = interp_arg.cfa.width;
+	job->height = interp_arg.cfa.height;
+	job->bits = get_output_bits(arg->imsetup.bitpix);
+	job->planes_count = mode == ALL_CHANNELS_BY_FILES ? 3 : 1;
+
+	job->meta.bitpixel = job->bits;
+	job->meta.width = job->width;
+	job->meta.height = job->height;
+
+	for (i = 0; i < job->planes_count; i++) {
+		interp_arg.channels[i] = job->planes_count == 3 ? i : (int) (mode - RED_ONLY);
+	}
+
+	interp_arg.planes_count = job->planes_count;
+
+	if (make_mosaic_frame(job, rawdata, &interpolate_rows, &interp_arg, get_raw_white_level(rawdata)) < 0) {
+		return -1;
+	}
+
+	log_debug(arg, "\tChannels interpolated from the raw mosaic, size = %ix%i\n", job->width, job->height);
+
+	return 0;
+}
+
+/* single channel modes don't need the debayered image, channels are taken from the mosaic */
+static int is_cfa_channels_mode(converter_params_t *arg, libraw_data_t *rawdata)
+{
+	switch (arg->imsetup.mode) {
+		case ALL_CHANNELS_BY_FILES:
+		case RED_ONLY:
+		case GREEN_ONLY:
+		case BLUE_ONLY:
+			break;
+
+		default:
+			return 0;
+	}
+
+	return arg->imsetup.cfa_channels != CFA_CHANNELS_DEBAYER && is_bayer_mosaic(rawdata)
+				&& rawdata->sizes.width >= 2 && rawdata->sizes.height >= 2;
+}
+
+/* stage 2: decode RAW and split the image into planes for the FITS */
+int raw2fits_decode(raw2fits_job_t *job)
 {
 	libraw_decoder_info_t decoder_info;
 	libraw_data_t *rawdata;
 	libraw_processed_image_t *proc_img;
-	char target_filename[512] = { 0 };
-	size_t target_filename_len;
-	fitsfile *fits;
-	uint16_t *framebuf;
-	int i, err;
-	int target_file_exists = 0;
+	frame_copy_arg_t frame_copy;
+	converter_params_t *arg = job->params;
+	int err, spare_cores;
 
-	rawdata = libraw_init(0);
+	rawdata = get_thread_decoder();
 
 	if (!rawdata) {
-		arg->logger_msg(arg->logger_arg, "Failed to init libraw, err: \n", strerror(errno));
-		return;
+		log_error(arg, "Failed to init libraw, err: %s\n", strerror(errno));
+		return -1;
 	}
 
-	err = libraw_open_file(rawdata, file);
+	err = libraw_open_buffer(rawdata, job->rawbuf, job->rawbuf_size);
 
 	if (err != LIBRAW_SUCCESS) {
 		print_error(arg, "Failed to open RAW file", err);
-		libraw_close(rawdata);
-		return;
+		libraw_recycle(rawdata);
+		return -1;
 	}
 
 	libraw_set_progress_handler(rawdata, &decoder_progress_callback, arg);
@@ -284,13 +1235,14 @@ void raw2fits(char *file, converter_params_t *arg)
 
 	if (err != LIBRAW_SUCCESS) {
 		print_error(arg, "Failed to unpack RAW file", err);
-		libraw_close(rawdata);
-		return;
+		libraw_recycle(rawdata);
+		return -1;
 	}
 
-	set_metadata_from_raw(rawdata, &arg->meta);
+	/* only the job's own copy is changed, params are shared by all threads */
+	set_metadata_from_raw(rawdata, &job->meta);
 
-	make_target_fits_filename(arg, file, target_filename, FILENAME_CHANNEL_POSTFIX[arg->imsetup.mode]);
+	make_target_fits_filename(arg, &job->meta, job->file, job->target_filename, FILENAME_CHANNEL_POSTFIX[arg->imsetup.mode]);
 
 	switch (rawdata->sizes.flip) {
 		case 0:
@@ -304,32 +1256,40 @@ void raw2fits(char *file, converter_params_t *arg)
 		case 6:
 			rawdata->params.user_flip = 7;
 			break;
+
+		default:
+			/* handle is reused, don't keep flip of the previous file */
+			rawdata->params.user_flip = -1;
+			break;
 	};
 
-	target_file_exists = is_file_exist(target_filename);
+	if (arg->imsetup.mode != ALL_CHANNELS_BY_FILES) {
+		if (check_target_file(arg, job->target_filename) < 0) {
+			libraw_recycle(rawdata);
+			return -1;
+		}
+	}
 
-	if (arg->imsetup.mode != ALL_CHANNELS_BY_FILES)
-	{
-		if (target_file_exists) {
-			if (!arg->fsetup.overwrite) {
-				arg->logger_msg(arg->logger_arg, "File %s is already exists, skipping...\n", target_filename);
-				libraw_recycle(rawdata);
-				libraw_close(rawdata);
-				return;
-			}
+	if (arg->imsetup.mode == RAW_CFA) {
+		return decode_cfa(job, rawdata);
+	}
 
-			if (remove_file(target_filename) < 0) {
-				arg->logger_msg(arg->logger_arg, "Unable to remove old file %s, error: \n", strerror(errno));
-				libraw_recycle(rawdata);
-				libraw_close(rawdata);
-				return;
-			}
+	if (arg->imsetup.binning > 1) {
+		return decode_binned(job, rawdata, arg->imsetup.binning, arg->imsetup.binning_sum);
+	}
+
+	if (is_cfa_channels_mode(arg, rawdata)) {
+		if (arg->imsetup.cfa_channels == CFA_CHANNELS_HALF) {
+			/* half resolution channel is the mean of its sites in 2x2 cell */
+			return decode_binned(job, rawdata, 2, 0);
 		}
+
+		return decode_interpolated(job, rawdata);
 	}
 
 	libraw_get_decoder_info(rawdata, &decoder_info);
 
-	arg->logger_msg(arg->logger_arg, "\tConverting raw image using %s\n", decoder_info.decoder_name);
+	log_debug(arg, "\tConverting raw image using %s\n", decoder_info.decoder_name);
 
 	rawdata->params.output_bps = 16;
 #if (LIBRAW_COMPILE_CHECK_VERSION_NOTLESS(0,17))
@@ -353,141 +1313,212 @@ void raw2fits(char *file, converter_params_t *arg)
 	#pragma message ("LibRaw version is to old, unable to use image corrections")
 #endif
 
+	spare_cores = job->take_spare_cores ? job->take_spare_cores() : 0;
+
+	set_decoder_threads(arg, spare_cores + 1);
+
 	err = libraw_dcraw_process(rawdata);
 
+	if (job->release_spare_cores) {
+		job->release_spare_cores(spare_cores);
+	}
+
 	if (err != LIBRAW_SUCCESS) {
 		print_error(arg, "Dcraw process failed", err);
 		libraw_free_image(rawdata);
 		libraw_recycle(rawdata);
-		libraw_close(rawdata);
-		return;
+		return -1;
 	}
 
-	proc_img = libraw_dcraw_make_mem_image(rawdata, &err);
+	memset(&frame_copy, 0, sizeof(frame_copy_arg_t));
 
-	libraw_free_image(rawdata);
+	if (can_read_raw_image(rawdata)) {
+		proc_img = NULL;
+
+		frame_copy.raw_image = (const uint16_t (*)[4]) rawdata->image;
+		frame_copy.flip = rawdata->sizes.flip;
+		frame_copy.raw_width = rawdata->sizes.width;
+		frame_copy.raw_height = rawdata->sizes.height;
+
+		job->width = frame_copy.flip & 4 ? rawdata->sizes.height : rawdata->sizes.width;
+		job->height = frame_copy.flip & 4 ? rawdata->sizes.width : rawdata->sizes.height;
+		job->bits = get_output_bits(arg->imsetup.bitpix);
+	} else {
+		proc_img = libraw_dcraw_make_mem_image(rawdata, &err);
+
+		libraw_free_image(rawdata);
+
+		if (!proc_img) {
+			print_error(arg, "Failed to make mem image", err);
+			libraw_recycle(rawdata);
+			return -1;
+		}
 
-	if (!proc_img) {
-		print_error(arg, "Failed to make mem image", err);
 		libraw_recycle(rawdata);
-		libraw_close(rawdata);
-		return;
+
+		frame_copy.image = (uint16_t *) proc_img->data;
+
+		job->width = proc_img->width;
+		job->height = proc_img->height;
+		job->bits = get_output_bits(arg->imsetup.bitpix);
 	}
 
-	arg->logger_msg(arg->logger_arg, "\tImage decoded, size = %ix%i, bits = %i, colors = %i\n",
-									proc_img->width, proc_img->height, proc_img->bits, proc_img->colors);
+	log_debug(arg, "\tImage decoded, size = %ix%i, BITPIX = %i%s\n",
+							job->width, job->height, arg->imsetup.bitpix, proc_img ? "" : ", read directly");
 
-	libraw_recycle(rawdata);
-	libraw_close(rawdata);
+	/* RAW data is not needed anymore, don't keep it in the writer queue */
+	free(job->rawbuf);
+	job->rawbuf = NULL;
+
+	job->meta.bitpixel = job->bits;
+	job->meta.width = job->width;
+	job->meta.height = job->height;
+
+	if (arg->imsetup.mode == ALL_CHANNELS_BY_FILES || arg->imsetup.mode == ALL_CHANNELS) {
+		job->planes_count = 3;
+	} else {
+		job->planes_count = 1;
+	}
+
+	err = get_frame_planes(job);
 
-	arg->meta.bitpixel = proc_img->bits;
-	arg->meta.width = proc_img->width;
-	arg->meta.height = proc_img->height;
+	if (err == 0) {
+		/* processed image has 16-bit range */
+		frame_copy.copy = FRAME_COPY[job->bits == FLOAT_IMG][arg->imsetup.mode];
+		frame_copy.planes = job->planes;
+		frame_copy.planes_count = job->planes_count;
+		frame_copy.sample_size = get_sample_size(job->bits);
+		frame_copy.scale = get_output_scale(job, UINT16_MAX);
+		frame_copy.width = job->width;
+		frame_copy.height = job->height;
 
-	framebuf = (uint16_t *) malloc(proc_img->width * proc_img->height * sizeof(uint16_t));
+		/* equal weights, same result as (r + g + b) / 3, computed once per frame */
+		gray_weights_init(&frame_copy.gray, 1, 1, 1);
 
-	if (!framebuf) {
-		arg->logger_msg(arg->logger_arg, "Failed to allocate memory for the frame, err: \n", strerror(err));
+		thread_pool_parallel_for(&copy_frame_band, &frame_copy,
+							(frame_copy.height + FRAME_BAND_ROWS - 1) / FRAME_BAND_ROWS);
+	}
+
+	if (proc_img) {
 		libraw_dcraw_clear_mem(proc_img);
+	} else {
+		libraw_free_image(rawdata);
+		libraw_recycle(rawdata);
 	}
 
-	if (arg->imsetup.mode == ALL_CHANNELS_BY_FILES) {
-		target_filename_len = strlen(target_filename);
+	return err;
+}
 
-		for (i = 0; i < 3; i++) {
-			strcpy(target_filename + target_filename_len - 5, FILENAME_CHANNEL_POSTFIX[i + 3]);
-			/* at this point we need to check file exists again... */
+/* stage 3: store planes to the FITS file(s) */
+int raw2fits_write(raw2fits_job_t *job)
+{
+	converter_params_t *arg = job->params;
+	size_t target_filename_len;
+	fits_output_t fits;
+	fits_header_t header;
+	int i, err;
 
-			target_file_exists = is_file_exist(target_filename);
+	make_file_header(&header, &job->meta);
 
-			if (target_file_exists) {
-				if (!arg->fsetup.overwrite) {
-					arg->logger_msg(arg->logger_arg, "File %s is already exists, skipping...\n", target_filename);
-					continue;
-				}
+	if (arg->imsetup.mode == ALL_CHANNELS_BY_FILES) {
+		target_filename_len = strlen(job->target_filename);
+
+		for (i = 0; i < 3; i++) {
+			strcpy(job->target_filename + target_filename_len - 5, FILENAME_CHANNEL_POSTFIX[i + 3]);
 
-				if (remove_file(target_filename) < 0) {
-					arg->logger_msg(arg->logger_arg, "Unable to remove old file %s, error: \n", strerror(errno));
-					continue;
-				}
+			/* at this point we need to check file exists again... */
+			if (check_target_file(arg, job->target_filename) < 0) {
+				continue;
 			}
 
-			arg->logger_msg(arg->logger_arg, "Creating FITS %s\n", target_filename);
+			log_info(arg, "Creating FITS %s\n", job->target_filename);
 
-			err = create_new_fits(&fits, target_filename);
+			err = create_new_fits(&fits, job->target_filename, arg->fits_backend);
 
 			if (err != 0) {
-				arg->logger_msg(arg->logger_arg, "Failed to create file, error %i\n", err);
+				log_error(arg, "Failed to create file, error %i\n", err);
 				continue;
 			}
 
-			err = create_fits_image(fits, proc_img->width, proc_img->height, proc_img->bits);
-			err = write_fits_header(fits, &arg->meta, FITS_HEADER_COMMENT[i + 3]);
+			err = create_fits_image(&fits, job->width, job->height, job->bits);
+			err = write_fits_header(&fits, &header, FITS_HEADER_COMMENT[i + 3]);
+
+			if (err == 0 && job->binning > 1) {
+				err = write_binning_keys(&fits, job->binning);
+			}
 
 			if (err != 0) {
-				arg->logger_msg(arg->logger_arg, "Failed to write FITS header, error %i\n", err);
+				log_error(arg, "Failed to write FITS header, error %i\n", err);
+				close_fits(&fits);
 				continue;
 			}
 
-			copy_image_buf(FRAME_COPY_MODES[i], proc_img, &framebuf);
-
-			write_fits_image(fits, framebuf, proc_img->width, proc_img->height);
-
-			close_fits(fits);
+			write_fits_image(&fits, job->planes[i], job->width, job->height, job->bits);
 
+			close_fits(&fits);
 		}
 
-	} else if (arg->imsetup.mode == ALL_CHANNELS) {
-		arg->logger_msg(arg->logger_arg, "Creating multi-image FITS %s\n", target_filename);
+		return 0;
+	}
 
-		err = create_new_fits(&fits, target_filename);
+	if (job->planes_count > 1) {
+		log_info(arg, "Creating multi-image FITS %s\n", job->target_filename);
+	} else {
+		log_info(arg, "Creating FITS %s\n", job->target_filename);
+	}
 
-		if (err != 0) {
-			arg->logger_msg(arg->logger_arg, "Failed to create file, error %i\n", err);
-			free(framebuf);
-			libraw_dcraw_clear_mem(proc_img);
-			return;
-		}
+	err = create_new_fits(&fits, job->target_filename, arg->fits_backend);
 
-		for (i = 0; i < 3; i++) {
-			copy_image_buf(FRAME_COPY_MODES[i], proc_img, &framebuf);
-			err = create_fits_image(fits, proc_img->width, proc_img->height, proc_img->bits);
-			err = write_fits_header(fits, &arg->meta, FITS_HEADER_COMMENT[i + 3]);
-			write_fits_image(fits, framebuf, proc_img->width, proc_img->height);
-		}
+	if (err != 0) {
+		log_error(arg, "Failed to create file, error %i\n", err);
+		return -1;
+	}
 
-		close_fits(fits);
+	for (i = 0; i < job->planes_count; i++) {
+		err = create_fits_image(&fits, job->width, job->height, job->bits);
+		err = write_fits_header(&fits, &header,
+					FITS_HEADER_COMMENT[job->planes_count > 1 ? i + 3 : arg->imsetup.mode]);
 
-	} else {
-		arg->logger_msg(arg->logger_arg, "Creating FITS %s\n", target_filename);
+		if (err == 0 && arg->imsetup.mode == RAW_CFA) {
+			err = write_bayer_keys(&fits, job->bayer_pattern);
+		}
 
-		err = create_new_fits(&fits, target_filename);
+		if (err == 0 && job->binning > 1) {
+			err = write_binning_keys(&fits, job->binning);
+		}
 
 		if (err != 0) {
-			arg->logger_msg(arg->logger_arg, "Failed to create file, error %i\n", err);
-			free(framebuf);
-			libraw_dcraw_clear_mem(proc_img);
-			return;
+			log_error(arg, "Failed to write FITS header, error %i\n", err);
+			close_fits(&fits);
+			return -1;
 		}
 
-		err = create_fits_image(fits, proc_img->width, proc_img->height, proc_img->bits);
-		err = write_fits_header(fits, &arg->meta, FITS_HEADER_COMMENT[arg->imsetup.mode]);
+		write_fits_image(&fits, job->planes[i], job->width, job->height, job->bits);
+	}
 
-		if (err != 0) {
-			arg->logger_msg(arg->logger_arg, "Failed to write FITS header, error %i\n", err);
-			free(framebuf);
-			libraw_dcraw_clear_mem(proc_img);
-			return;
-		}
+	close_fits(&fits);
 
-		copy_image_buf(arg->imsetup.mode, proc_img, &framebuf);
+	return 0;
+}
 
-		write_fits_image(fits, framebuf, proc_img->width, proc_img->height);
+void raw2fits_release(raw2fits_job_t *job)
+{
+	int i;
 
-		close_fits(fits);
+	if (job->rawbuf) {
+		free(job->rawbuf);
+		job->rawbuf = NULL;
 	}
 
-	free(framebuf);
-	libraw_dcraw_clear_mem(proc_img);
-}
+	/* frame buffers go back to the pool for the next file */
+	for (i = 0; i < RAW2FITS_MAX_PLANES; i++) {
+		if (job->frames[i]) {
+			frame_pool_put(job->frames[i]);
+			job->frames[i] = NULL;
+		}
 
+		job->planes[i] = NULL;
+	}
+
+	job->planes_count = 0;
+}
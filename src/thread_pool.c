@@ -1,6 +1,6 @@
 /* 
    thread_pool.c
-    - simple threads launcher and storage
+    - simple threads pool with per-worker tasks queues and work stealing
 
    Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
 
@@ -22,58 +22,417 @@
 #include <stdlib.h>
 #include "thread_pool.h"
 
+typedef struct pool_task {
+	thread_task task;
+	void *task_arg;
+	long cost;
+	int helper;
+	struct pool_task *next;
+} pool_task_t;
+
+/* indices are claimed by the caller and the helpers, the last reference frees it */
+typedef struct parallel_for {
+	range_task task;
+	void *task_arg;
+	size_t count;
+	size_t next;
+	size_t done;
+	int refs;
+	pthread_mutex_t lock;
+	pthread_cond_t done_cond;
+} parallel_for_t;
+
+typedef struct worker_queue {
+	pthread_mutex_t lock;
+	pool_task_t *head;
+	pool_task_t *tail;
+	long queued_cost;
+	int queued_tasks;
+} worker_queue_t;
+
 static pthread_t *threads = NULL;
+static worker_queue_t *queues = NULL;
 static int total_threads = 0;
-static int threads_pool_cursor = 0;
 
-static pthread_mutex_t pool_lock;
+static int pending_tasks = 0;
+static int pending_file_tasks = 0;
+static int idle_workers = 0;
+static int max_pending_tasks = 0;
+static int pool_shutdown = 0;
+
+static pthread_mutex_t idle_lock;
+static pthread_cond_t idle_cond;
+static pthread_cond_t space_cond;
+
+/* 
+   Queue is kept in the cost order, the most expensive task is at the head, equal ones keep the order.
+   Helpers go first, the caller of parallel_for is waiting for them.
+ */
+static void queue_push(worker_queue_t *queue, pool_task_t *ptask)
+{
+	pool_task_t *prev = NULL, *cur;
+
+	pthread_mutex_lock(&queue->lock);
+
+	for (cur = queue->head; cur && !ptask->helper && (cur->helper || cur->cost >= ptask->cost); cur = cur->next) {
+		prev = cur;
+	}
+
+	ptask->next = cur;
+
+	if (prev) {
+		prev->next = ptask;
+	} else {
+		queue->head = ptask;
+	}
+
+	if (!cur) {
+		queue->tail = ptask;
+	}
+
+	__atomic_add_fetch(&queue->queued_cost, ptask->cost, __ATOMIC_RELAXED);
+	__atomic_add_fetch(&queue->queued_tasks, 1, __ATOMIC_RELAXED);
+
+	pthread_mutex_unlock(&queue->lock);
+}
+
+static pool_task_t *queue_pop(worker_queue_t *queue)
+{
+	pool_task_t *ptask;
+
+	pthread_mutex_lock(&queue->lock);
+
+	ptask = queue->head;
+
+	if (ptask) {
+		queue->head = ptask->next;
+
+		if (!queue->head) {
+			queue->tail = NULL;
+		}
+
+		__atomic_sub_fetch(&queue->queued_cost, ptask->cost, __ATOMIC_RELAXED);
+		__atomic_sub_fetch(&queue->queued_tasks, 1, __ATOMIC_RELAXED);
+	}
+
+	pthread_mutex_unlock(&queue->lock);
+
+	return ptask;
+}
+
+/* 
+   Idle worker takes the next task from the most loaded queue.
+   Queues are kept in the cost order, so the head of the victim is
+   the most expensive task left there: big files are never left for the end.
+ */
+static pool_task_t *steal_task(int thief)
+{
+	int i, victim = -1;
+	long cost, max_cost = -1;
+
+	for (i = 0; i < total_threads; i++) {
+		if (i == thief || !__atomic_load_n(&queues[i].queued_tasks, __ATOMIC_RELAXED)) {
+			continue;
+		}
+
+		cost = __atomic_load_n(&queues[i].queued_cost, __ATOMIC_RELAXED);
+
+		if (cost > max_cost) {
+			max_cost = cost;
+			victim = i;
+		}
+	}
+
+	if (victim < 0) {
+		return NULL;
+	}
+
+	return queue_pop(&queues[victim]);
+}
+
+static pool_task_t *get_next_task(int worker)
+{
+	pool_task_t *ptask;
+
+	while (1) {
+		ptask = queue_pop(&queues[worker]);
+
+		if (!ptask) {
+			ptask = steal_task(worker);
+		}
+
+		pthread_mutex_lock(&idle_lock);
+
+		if (ptask) {
+			pending_tasks--;
+
+			if (!ptask->helper) {
+				pending_file_tasks--;
+			}
+
+			pthread_cond_signal(&space_cond);
+			pthread_mutex_unlock(&idle_lock);
+			return ptask;
+		}
+
+		if (pending_tasks == 0) {
+			if (pool_shutdown) {
+				pthread_mutex_unlock(&idle_lock);
+				return NULL;
+			}
+
+			idle_workers++;
+			pthread_cond_wait(&idle_cond, &idle_lock);
+			idle_workers--;
+		}
+
+		pthread_mutex_unlock(&idle_lock);
+	}
+}
 
-void init_thread_pool(size_t num_threads)
+static void *worker_func(void *arg)
 {
+	int worker = (int) (long) arg;
+	pool_task_t *ptask;
+
+	/* queues are drained completely before the shutdown */
+	while ((ptask = get_next_task(worker))) {
+		(*ptask->task) (ptask->task_arg);
+		free(ptask);
+	}
+
+	return NULL;
+}
+
+void init_thread_pool(size_t num_threads, int max_pending)
+{
+	int i;
+
 	if (threads) {
 		cleanup_thread_pool();
 	}
 
-	pthread_mutex_init(&pool_lock, NULL);
+	pthread_mutex_init(&idle_lock, NULL);
+	pthread_cond_init(&idle_cond, NULL);
+	pthread_cond_init(&space_cond, NULL);
+
+	pool_shutdown = 0;
+	pending_tasks = 0;
+	pending_file_tasks = 0;
+	idle_workers = 0;
+	max_pending_tasks = max_pending;
+
+	queues = (worker_queue_t *) calloc(num_threads, sizeof(worker_queue_t));
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_mutex_init(&queues[i].lock, NULL);
+	}
 
-	threads = (pthread_t*) malloc (sizeof(pthread_t) * num_threads);
 	total_threads = num_threads;
+
+	threads = (pthread_t*) malloc (sizeof(pthread_t) * num_threads);
+
+	for (i = 0; i < num_threads; i++) {
+		pthread_create(&threads[i], NULL, worker_func, (void *) (long) i);
+	}
 }
 
-void thread_pool_add_task(thread_task task, void *task_arg)
+/* the least loaded worker gets the new task, called with idle_lock held */
+static void submit_task(pool_task_t *ptask)
 {
-	pthread_t *curr_thread = &threads[threads_pool_cursor];
-	pthread_create(curr_thread, NULL, task, task_arg);
+	int i, target = 0;
+	long cost_min;
+
+	cost_min = __atomic_load_n(&queues[0].queued_cost, __ATOMIC_RELAXED);
+
+	for (i = 1; i < total_threads; i++) {
+		long queue_cost = __atomic_load_n(&queues[i].queued_cost, __ATOMIC_RELAXED);
+
+		if (queue_cost < cost_min) {
+			cost_min = queue_cost;
+			target = i;
+		}
+	}
 
-	threads_pool_cursor++;
+	queue_push(&queues[target], ptask);
+
+	pending_tasks++;
+	pthread_cond_broadcast(&idle_cond);
 }
 
-void cleanup_thread_pool()
+void thread_pool_add_task(thread_task task, void *task_arg, long cost)
 {
-	int i;
+	pool_task_t *ptask = (pool_task_t *) malloc(sizeof(pool_task_t));
 
-	for (i = 0; i < total_threads; i++) {
-		pthread_join(threads[i], NULL);
+	ptask->task = task;
+	ptask->task_arg = task_arg;
+	ptask->cost = cost;
+	ptask->helper = 0;
+	ptask->next = NULL;
+
+	pthread_mutex_lock(&idle_lock);
+
+	/* bounded pool: producer waits for the workers to take some tasks */
+	while (max_pending_tasks > 0 && pending_tasks >= max_pending_tasks) {
+		pthread_cond_wait(&space_cond, &idle_lock);
 	}
 
-	if (threads) {
-		free(threads);
-		threads = NULL;
+	submit_task(ptask);
+	pending_file_tasks++;
+
+	pthread_mutex_unlock(&idle_lock);
+}
+
+static void parallel_for_run(parallel_for_t *pf)
+{
+	size_t index;
+
+	while ((index = __atomic_fetch_add(&pf->next, 1, __ATOMIC_RELAXED)) < pf->count) {
+		(*pf->task) (pf->task_arg, index);
+
+		if (__atomic_add_fetch(&pf->done, 1, __ATOMIC_ACQ_REL) == pf->count) {
+			pthread_mutex_lock(&pf->lock);
+			pthread_cond_signal(&pf->done_cond);
+			pthread_mutex_unlock(&pf->lock);
+		}
 	}
+}
 
-	total_threads = 0;
-	threads_pool_cursor = 0;
+static void parallel_for_unref(parallel_for_t *pf)
+{
+	if (__atomic_sub_fetch(&pf->refs, 1, __ATOMIC_ACQ_REL) == 0) {
+		pthread_cond_destroy(&pf->done_cond);
+		pthread_mutex_destroy(&pf->lock);
+		free(pf);
+	}
+}
+
+/* helper may start after all indices are taken, then it only drops the reference */
+static void *parallel_for_helper(void *arg)
+{
+	parallel_for_t *pf = (parallel_for_t *) arg;
+
+	parallel_for_run(pf);
+	parallel_for_unref(pf);
 
-	pthread_mutex_destroy(&pool_lock);
+	return NULL;
 }
 
-void task_enter_critical_section()
+/* 
+   Runs task for every index in 0..count-1 and returns when all of them are done.
+   Caller works on the indices itself, idle workers are asked to help. Helpers are not limited
+   by max_pending, so the caller never waits for the queue space and there is no deadlock
+   when it's a pool worker. Without idle workers everything is done by the caller.
+ */
+void thread_pool_parallel_for(range_task task, void *task_arg, size_t count)
 {
-	pthread_mutex_lock(&pool_lock);
+	parallel_for_t *pf;
+	pool_task_t *ptask;
+	size_t i;
+	int helpers = 0;
+
+	if (threads && count > 1) {
+		pthread_mutex_lock(&idle_lock);
+		helpers = idle_workers < count - 1 ? idle_workers : count - 1;
+		pthread_mutex_unlock(&idle_lock);
+	}
+
+	pf = helpers > 0 ? (parallel_for_t *) malloc(sizeof(parallel_for_t)) : NULL;
+
+	if (!pf) {
+		for (i = 0; i < count; i++) {
+			(*task) (task_arg, i);
+		}
+
+		return;
+	}
+
+	pf->task = task;
+	pf->task_arg = task_arg;
+	pf->count = count;
+	pf->next = 0;
+	pf->done = 0;
+	pf->refs = helpers + 1;
+
+	pthread_mutex_init(&pf->lock, NULL);
+	pthread_cond_init(&pf->done_cond, NULL);
+
+	pthread_mutex_lock(&idle_lock);
+
+	for (i = 0; i < helpers; i++) {
+		ptask = (pool_task_t *) malloc(sizeof(pool_task_t));
+
+		if (!ptask) {
+			__atomic_sub_fetch(&pf->refs, helpers - i, __ATOMIC_ACQ_REL);
+			break;
+		}
+
+		ptask->task = &parallel_for_helper;
+		ptask->task_arg = pf;
+		ptask->cost = 0;
+		ptask->helper = 1;
+		ptask->next = NULL;
+
+		submit_task(ptask);
+	}
+
+	pthread_mutex_unlock(&idle_lock);
+
+	parallel_for_run(pf);
+
+	pthread_mutex_lock(&pf->lock);
+
+	while (__atomic_load_n(&pf->done, __ATOMIC_ACQUIRE) < count) {
+		pthread_cond_wait(&pf->done_cond, &pf->lock);
+	}
+
+	pthread_mutex_unlock(&pf->lock);
+
+	parallel_for_unref(pf);
 }
 
-void task_exit_critical_section()
+/* tasks added by thread_pool_add_task() which are not taken by the workers yet, parallel_for helpers are not counted */
+int thread_pool_pending_tasks()
 {
-	pthread_mutex_unlock(&pool_lock);
+	int pending;
+
+	pthread_mutex_lock(&idle_lock);
+	pending = pending_file_tasks;
+	pthread_mutex_unlock(&idle_lock);
+
+	return pending;
 }
 
+void cleanup_thread_pool()
+{
+	int i;
+
+	if (!threads) {
+		return;
+	}
+
+	pthread_mutex_lock(&idle_lock);
+	pool_shutdown = 1;
+	pthread_cond_broadcast(&idle_cond);
+	pthread_mutex_unlock(&idle_lock);
+
+	for (i = 0; i < total_threads; i++) {
+		pthread_join(threads[i], NULL);
+	}
+
+	for (i = 0; i < total_threads; i++) {
+		pthread_mutex_destroy(&queues[i].lock);
+	}
+
+	free(threads);
+	threads = NULL;
+
+	free(queues);
+	queues = NULL;
+
+	total_threads = 0;
+
+	pthread_cond_destroy(&space_cond);
+	pthread_cond_destroy(&idle_cond);
+	pthread_mutex_destroy(&idle_lock);
+}
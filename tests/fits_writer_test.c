@@ -0,0 +1,202 @@
+/* 
+   fits_writer_test.c
+    - writes the same HDUs through cfitsio and the native writer, files must be the same
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+#include <stdint.h>
+#include <unistd.h>
+#include <fitsio.h>
+#include "fits_writer.h"
+
+#define TEST_WIDTH 37
+#define TEST_HEIGHT 23
+#define TEST_PIXELS (TEST_WIDTH * TEST_HEIGHT)
+
+static const char *STRING_VALUES[] = {
+	"",
+	"M 31",
+	"O'Brien's scope",
+	"a very long string value which goes past the sixty eight characters limit of the card"
+};
+
+static const float FLOAT_VALUES[] = { 0.0f, -12.5f, 0.2f, 1e-5f, 44.7281f, 123456789.0f };
+
+static const int INT_VALUES[] = { 0, 30, -600, 1234567890 };
+
+static const char *LONG_COMMENT = "a long comment which takes more than one card, it is split by"
+							" seventy two characters, the same way as cfitsio does it";
+
+static uint16_t u16_frame[TEST_PIXELS];
+static float f32_frame[TEST_PIXELS];
+
+static uint16_t fits_order(uint16_t val)
+{
+	val ^= 0x8000;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	val = (uint16_t) ((val << 8) | (val >> 8));
+#endif
+
+	return val;
+}
+
+static void fill_frames()
+{
+	int i;
+
+	for (i = 0; i < TEST_PIXELS; i++) {
+		u16_frame[i] = (uint16_t) (i * 997);
+		f32_frame[i] = i * 0.001f - 0.25f;
+	}
+}
+
+static int write_cfitsio(const char *filename)
+{
+	fitsfile *fptr;
+	long naxes[2] = { TEST_WIDTH, TEST_HEIGHT };
+	long fpx[2] = { 1L, 1L };
+	char card[FLEN_CARD], str[FLEN_VALUE];
+	int i, logical = 1, status = 0;
+
+	fits_create_file(&fptr, filename, &status);
+
+	fits_create_img(fptr, USHORT_IMG, 2, naxes, &status);
+
+	for (i = 0; i < sizeof(STRING_VALUES) / sizeof(STRING_VALUES[0]); i++) {
+		fits_write_key(fptr, TSTRING, "STRKEY", (void *) STRING_VALUES[i], "string value", &status);
+	}
+
+	for (i = 0; i < sizeof(FLOAT_VALUES) / sizeof(FLOAT_VALUES[0]); i++) {
+		fits_write_key(fptr, TFLOAT, "FLTKEY", (void *) &FLOAT_VALUES[i], "float value", &status);
+	}
+
+	for (i = 0; i < sizeof(INT_VALUES) / sizeof(INT_VALUES[0]); i++) {
+		fits_write_key(fptr, TINT, "INTKEY", (void *) &INT_VALUES[i], "int value with a long comment"
+										" which does not fit into the card", &status);
+	}
+
+	fits_write_key(fptr, TLOGICAL, "LOGKEY", &logical, NULL, &status);
+
+	/* prepared cards, the same way raw2fits makes the header template */
+	ffs2c((char *) STRING_VALUES[2], str, &status);
+	ffmkky("OBSERVER", str, "observer name", card, &status);
+	fits_write_record(fptr, card, &status);
+
+	ffr2e(FLOAT_VALUES[4], -7, str, &status);
+	ffmkky("SITELAT", str, "site latitude", card, &status);
+	fits_write_record(fptr, card, &status);
+
+	fits_write_comment(fptr, LONG_COMMENT, &status);
+
+	fits_write_pix(fptr, TUSHORT, fpx, TEST_PIXELS, u16_frame, &status);
+
+	fits_create_img(fptr, FLOAT_IMG, 2, naxes, &status);
+	fits_write_key(fptr, TSTRING, "STRKEY", (void *) STRING_VALUES[1], "string value", &status);
+	fits_write_pix(fptr, TFLOAT, fpx, TEST_PIXELS, f32_frame, &status);
+
+	fits_close_file(fptr, &status);
+
+	return status;
+}
+
+static int write_native(const char *filename)
+{
+	fits_writer_t fw;
+	uint16_t u16_data[TEST_PIXELS];
+	float f32_data[TEST_PIXELS];
+	char card[FITS_CARD_SIZE + 1];
+	int i, logical = 1, status = 0;
+
+	for (i = 0; i < TEST_PIXELS; i++) {
+		u16_data[i] = fits_order(u16_frame[i]);
+	}
+
+	memcpy(f32_data, f32_frame, sizeof(f32_data));
+
+	fits_writer_create(&fw, filename, &status);
+
+	fits_writer_create_img(&fw, USHORT_IMG, TEST_WIDTH, TEST_HEIGHT, &status);
+
+	for (i = 0; i < sizeof(STRING_VALUES) / sizeof(STRING_VALUES[0]); i++) {
+		fits_writer_write_key(&fw, TSTRING, "STRKEY", (void *) STRING_VALUES[i], "string value", &status);
+	}
+
+	for (i = 0; i < sizeof(FLOAT_VALUES) / sizeof(FLOAT_VALUES[0]); i++) {
+		fits_writer_write_key(&fw, TFLOAT, "FLTKEY", (void *) &FLOAT_VALUES[i], "float value", &status);
+	}
+
+	for (i = 0; i < sizeof(INT_VALUES) / sizeof(INT_VALUES[0]); i++) {
+		fits_writer_write_key(&fw, TINT, "INTKEY", (void *) &INT_VALUES[i], "int value with a long comment"
+										" which does not fit into the card", &status);
+	}
+
+	fits_writer_write_key(&fw, TLOGICAL, "LOGKEY", &logical, NULL, &status);
+
+	fits_writer_make_key(TSTRING, "OBSERVER", (void *) STRING_VALUES[2], "observer name", card, &status);
+	fits_writer_write_record(&fw, card, &status);
+
+	fits_writer_make_key(TFLOAT, "SITELAT", (void *) &FLOAT_VALUES[4], "site latitude", card, &status);
+	fits_writer_write_record(&fw, card, &status);
+
+	fits_writer_write_comment(&fw, LONG_COMMENT, &status);
+
+	fits_writer_write_image(&fw, u16_data, TEST_WIDTH, TEST_HEIGHT, USHORT_IMG, &status);
+
+	fits_writer_create_img(&fw, FLOAT_IMG, TEST_WIDTH, TEST_HEIGHT, &status);
+	fits_writer_write_key(&fw, TSTRING, "STRKEY", (void *) STRING_VALUES[1], "string value", &status);
+	fits_writer_write_image(&fw, f32_data, TEST_WIDTH, TEST_HEIGHT, FLOAT_IMG, &status);
+
+	fits_writer_close(&fw, &status);
+
+	return status;
+}
+
+int main(int argc, char **argv)
+{
+	int status;
+
+	if (argc != 3) {
+		printf("Usage: %s <cfitsio file> <native file>\n", argv[0]);
+		return 1;
+	}
+
+	fill_frames();
+
+	/* neither of the writers overwrites the file */
+	unlink(argv[1]);
+	unlink(argv[2]);
+
+	status = write_cfitsio(argv[1]);
+
+	if (status != 0) {
+		printf("cfitsio writer failed, status = %i\n", status);
+		return 1;
+	}
+
+	status = write_native(argv[2]);
+
+	if (status != 0) {
+		printf("Native writer failed, status = %i\n", status);
+		return 1;
+	}
+
+	return 0;
+}
@@ -0,0 +1,248 @@
+/* 
+   pixel_kernels_test.c
+    - kernels of every supported instruction set against the plain conversion and the scalar set
+
+   Copyright 2017  Oleg Kutkov <elenbert@gmail.com>
+
+   This program is free software: you can redistribute it and/or modify
+   it under the terms of the GNU General Public License as published by
+   the Free Software Foundation, either version 3 of the License, or
+   (at your option) any later version.
+
+   This program is distributed in the hope that it will be useful,
+   but WITHOUT ANY WARRANTY; without even the implied warranty of
+   MERCHANTABILITY or FITNESS FOR A PARTICULAR PURPOSE.  See the
+   GNU General Public License for more details.
+
+   You should have received a copy of the GNU General Public License
+   along with this program.  If not, see <http://www.gnu.org/licenses/>.  
+ */
+
+#include <stdio.h>
+#include <string.h>
+#include <stdint.h>
+#include "pixel_kernels.h"
+
+/* every possible r + g + b */
+#define SUMS_COUNT (3 * 65535 + 1)
+
+static const char *KERNEL_SETS[] = { "scalar", "sse2", "ssse3", "avx2", "avx512", "neon" };
+
+/* interleaved source, outputs of the tested set and of the scalar one */
+static uint16_t rgb[SUMS_COUNT * 3];
+static uint16_t out[3][SUMS_COUNT];
+static uint16_t ref[3][SUMS_COUNT];
+static float fout[3][SUMS_COUNT];
+static float fref[3][SUMS_COUNT];
+
+/* float kernels are checked with the scaling and weights which are not exact in binary */
+static const float FLOAT_SCALE = 1.0f / 65535;
+static const float FLOAT_MUL[3] = { 0.299f / 65535, 0.587f / 65535, 0.114f / 65535 };
+
+static uint16_t fits_order(uint16_t val)
+{
+	val ^= 0x8000;
+
+#if __BYTE_ORDER__ == __ORDER_LITTLE_ENDIAN__
+	val = (uint16_t) ((val << 8) | (val >> 8));
+#endif
+
+	return val;
+}
+
+/* the sum is spread over the channels in the different order, so every lane gets all of them */
+static void fill_pixels(uint16_t *rgb, size_t pixels)
+{
+	uint32_t sum, part;
+	size_t i;
+	int c;
+
+	for (i = 0; i < pixels; i++) {
+		sum = i;
+
+		for (c = 0; c < 3; c++) {
+			part = sum < 65535 ? sum : 65535;
+			rgb[i * 3 + (c + i) % 3] = part;
+			sum -= part;
+		}
+	}
+}
+
+/* the output of the current set must be the same as the scalar one, bit for bit */
+static int compare_planes(const char *name, const char *kernel, const void *out, const void *ref, size_t size)
+{
+	if (memcmp(out, ref, size) != 0) {
+		printf("%s: %s differs from scalar\n", name, kernel);
+		return 1;
+	}
+
+	return 0;
+}
+
+static int check_gray(const char *name, size_t offset, size_t pixels)
+{
+	gray_weights_t gw;
+	size_t i;
+	uint16_t expected;
+	int errors = 0;
+
+	gray_weights_init(&gw, 1, 1, 1);
+
+	rgb48_to_gray(rgb + offset * 3, out[0], pixels, &gw);
+
+	for (i = 0; i < pixels; i++) {
+		expected = (i + offset) / 3;
+
+		if (out[0][i] != expected && errors++ < 10) {
+			printf("%s: sum %zu gives %u, expected %u\n", name, i + offset, out[0][i], expected);
+		}
+	}
+
+	rgb48_to_gray_fits(rgb + offset * 3, out[0], pixels, &gw);
+
+	for (i = 0; i < pixels; i++) {
+		expected = fits_order((i + offset) / 3);
+
+		if (out[0][i] != expected && errors++ < 10) {
+			printf("%s: sum %zu gives FITS 0x%04x, expected 0x%04x\n", name, i + offset, out[0][i], expected);
+		}
+	}
+
+	return errors;
+}
+
+/* separate output and in place, interleaved source is taken as the plain 16-bit plane */
+static int check_u16_to_fits(const char *name, size_t offset, size_t pixels)
+{
+	const uint16_t *src = rgb + offset * 3;
+	size_t i;
+	int errors = 0;
+
+	u16_to_fits(src, out[0], pixels);
+
+	memcpy(out[1], src, pixels * sizeof(uint16_t));
+	u16_to_fits(out[1], out[1], pixels);
+
+	for (i = 0; i < pixels; i++) {
+		if (out[0][i] != fits_order(src[i]) && errors++ < 10) {
+			printf("%s: u16_to_fits gives 0x%04x at %zu, expected 0x%04x\n", name, out[0][i], i, fits_order(src[i]));
+		}
+
+		if (out[1][i] != fits_order(src[i]) && errors++ < 10) {
+			printf("%s: in place u16_to_fits gives 0x%04x at %zu, expected 0x%04x\n", name, out[1][i], i, fits_order(src[i]));
+		}
+	}
+
+	return errors;
+}
+
+static int check_channels(const char *name, size_t offset, size_t pixels)
+{
+	const uint16_t *src = rgb + offset * 3;
+	size_t size = pixels * sizeof(uint16_t);
+	size_t i;
+	int c, errors = 0;
+
+	pixel_kernels_select("scalar");
+	deinterleave_rgb48_fits(src, ref[0], ref[1], ref[2], pixels);
+
+	pixel_kernels_select(name);
+	deinterleave_rgb48_fits(src, out[0], out[1], out[2], pixels);
+
+	for (c = 0; c < 3; c++) {
+		errors += compare_planes(name, "deinterleave_rgb48_fits", out[c], ref[c], size);
+	}
+
+	extract_rgb48_red_fits(src, out[0], pixels);
+	extract_rgb48_green_fits(src, out[1], pixels);
+	extract_rgb48_blue_fits(src, out[2], pixels);
+
+	for (c = 0; c < 3; c++) {
+		errors += compare_planes(name, "extract_rgb48_fits", out[c], ref[c], size);
+	}
+
+	/* scalar set itself is checked against the plain conversion */
+	for (i = 0; i < pixels; i++) {
+		for (c = 0; c < 3; c++) {
+			if (ref[c][i] != fits_order(src[i * 3 + c])) {
+				printf("scalar: deinterleave_rgb48_fits is wrong at pixel %zu\n", i);
+				return errors + 1;
+			}
+		}
+	}
+
+	return errors;
+}
+
+static int check_float(const char *name, size_t offset, size_t pixels)
+{
+	const uint16_t *src = rgb + offset * 3;
+	size_t size = pixels * sizeof(float);
+	int c, errors = 0;
+
+	pixel_kernels_select("scalar");
+	deinterleave_rgb48_f32(src, fref[0], fref[1], fref[2], pixels, FLOAT_SCALE);
+
+	pixel_kernels_select(name);
+	deinterleave_rgb48_f32(src, fout[0], fout[1], fout[2], pixels, FLOAT_SCALE);
+
+	for (c = 0; c < 3; c++) {
+		errors += compare_planes(name, "deinterleave_rgb48_f32", fout[c], fref[c], size);
+	}
+
+	pixel_kernels_select("scalar");
+	rgb48_to_f32(src, fref[0], pixels, FLOAT_MUL);
+
+	pixel_kernels_select(name);
+	rgb48_to_f32(src, fout[0], pixels, FLOAT_MUL);
+
+	errors += compare_planes(name, "rgb48_to_f32", fout[0], fref[0], size);
+
+	/* interleaved source is taken as the plain 16-bit plane */
+	pixel_kernels_select("scalar");
+	u16_to_f32(src, fref[0], pixels, FLOAT_SCALE);
+
+	pixel_kernels_select(name);
+	u16_to_f32(src, fout[0], pixels, FLOAT_SCALE);
+
+	errors += compare_planes(name, "u16_to_f32", fout[0], fref[0], size);
+
+	return errors;
+}
+
+static int check_set(const char *name)
+{
+	size_t offset;
+	int errors = 0;
+
+	/* unaligned start and odd length go through the tails of the vector loops */
+	for (offset = 0; offset < 2; offset++) {
+		errors += check_gray(name, offset, SUMS_COUNT - offset);
+		errors += check_u16_to_fits(name, offset, SUMS_COUNT - offset);
+		errors += check_channels(name, offset, SUMS_COUNT - offset);
+		errors += check_float(name, offset, SUMS_COUNT - offset);
+	}
+
+	return errors;
+}
+
+int main()
+{
+	int i, errors = 0;
+
+	fill_pixels(rgb, SUMS_COUNT);
+
+	for (i = 0; i < sizeof(KERNEL_SETS) / sizeof(KERNEL_SETS[0]); i++) {
+		if (pixel_kernels_select(KERNEL_SETS[i]) != 0) {
+			continue;
+		}
+
+		if (check_set(KERNEL_SETS[i]) == 0) {
+			printf("%s: OK\n", KERNEL_SETS[i]);
+		} else {
+			errors++;
+		}
+	}
+
+	return errors ? 1 : 0;
+}